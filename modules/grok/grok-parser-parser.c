@@ -34,6 +34,7 @@ static CfgLexerKeyword grok_keywords[] = {
   { "grok",                 KW_GROK },
   { "match",            KW_GROK_MATCH },
   { "pattern_directory",            KW_GROK_PATTERN_DIRECTORY },
+  { "watch_pattern_directory",      KW_GROK_WATCH_PATTERN_DIRECTORY },
   { "custom_pattern",            KW_GROK_CUSTOM_PATTERN },
   { NULL }
 };
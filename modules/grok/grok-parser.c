@@ -24,11 +24,27 @@
 #include "grok-parser.h"
 #include <grok.h>
 #include <grok_pattern.h>
+#include <grok_capture.h>
 #include "scratch-buffers.h"
 #include "string-list.h"
+#include "type-hinting.h"
+#include "mainloop.h"
+#include "mainloop-io-worker.h"
+
+#include <iv.h>
+#if SYSLOG_NG_HAVE_INOTIFY
+#include <iv_inotify.h>
+#endif
 
 #define KEY_BUFFER_LENGTH 1024
 
+/* seconds to wait for further changes in the pattern directory before recompiling */
+#define GROK_PATTERN_RELOAD_DELAY 1
+
+/* shorter literals are present in almost every message, checking them
+ * would not save any regex executions */
+#define GROK_PREFILTER_MIN_LITERAL_LEN 3
+
 struct _GrokInstance
 {
   grok_t *grok;
@@ -36,14 +52,33 @@ struct _GrokInstance
   char *key_prefix;
   int key_prefix_len;
   GList *tags;
+  GHashTable *captures;
+  char *required_literal;
 }; 
 
+/* a named capture of a compiled pattern, resolved once at init time */
+typedef struct _GrokCapture
+{
+  NVHandle handle;
+  TypeHint type;
+} GrokCapture;
+
 typedef struct _GrokPattern 
 {
   char *name;
   char *pattern;
 } GrokPattern;
 
+/* A compiled set of grok instances. Message processing holds the read side
+ * of patterns_lock while matching against the current set, a pattern
+ * directory reload compiles a new one in the background and swaps it in
+ * under the write side, so the old set can be freed right away. */
+typedef struct _GrokPatternSet
+{
+  gint ref_cnt;
+  GList *instances;
+} GrokPatternSet;
+
 typedef struct _GrokParser
 {
   LogParser super;
@@ -54,6 +89,20 @@ typedef struct _GrokParser
   int key_prefix_len;
   LogTemplate *template;
   gboolean debug;
+  gboolean watch_pattern_dir;
+
+  GrokPatternSet *patterns;
+  GRWLock patterns_lock;
+
+  gboolean watching;
+  gboolean reload_pending;
+  GrokPatternSet *reloaded_patterns;
+  MainLoopIOWorkerJob reload_job;
+  struct iv_timer reload_timer;
+#if SYSLOG_NG_HAVE_INOTIFY
+  struct iv_inotify inotify;
+  struct iv_inotify_watch pattern_dir_watch;
+#endif
 } GrokParser;
 
 GrokInstance *
@@ -86,6 +135,13 @@ grok_parser_turn_on_debug(LogParser *parser)
   self->debug = TRUE;
 }
 
+void
+grok_parser_set_watch_pattern_directory(LogParser *parser, gboolean watch)
+{
+  GrokParser *self = (GrokParser *)parser;
+  self->watch_pattern_dir = watch;
+}
+
 static void
 grok_instance_pattern_list_foreach(gpointer pattern, gpointer user_data)
 {
@@ -112,11 +168,15 @@ grok_instance_free(gpointer obj)
   GrokInstance *self = (GrokInstance *) obj;
   string_list_free(self->tags);
   g_free(self->grok_pattern);
+  g_free(self->required_literal);
+  if (self->captures)
+    g_hash_table_destroy(self->captures);
   if (self->grok)
     {
       grok_free(self->grok);
       g_free(self->grok);
     }
+  g_free(self);
 };
 
 static void
@@ -143,6 +203,363 @@ grok_patterns_import_from_directory(GrokInstance *self, GrokParser *parser)
   g_dir_close(dir);
 }
 
+static gboolean
+_parse_type_suffix(const char *suffix, TypeHint *type)
+{
+  /* logstash spells doubles as "float" */
+  if (strcmp(suffix, "float") == 0)
+    suffix = "double";
+
+  return type_hint_parse(suffix, type, NULL);
+}
+
+static void
+_split_and_add_key_prefix(GrokInstance *self, char *key_buffer, char *key, int key_len, TypeHint *type)
+{
+  char *key_start = strchr(key, ':');
+  char *type_start;
+
+  *type = TYPE_HINT_STRING;
+
+  if (key_start == NULL)
+    key_start = key;
+  else
+   {
+     key_start = key_start + 1;
+     key_len = key_len - (key_start - key);
+   }
+
+  type_start = strrchr(key_start, ':');
+  if (type_start && _parse_type_suffix(type_start + 1, type))
+    key_len = type_start - key_start;
+
+  if (key_len > (KEY_BUFFER_LENGTH - 1) - self->key_prefix_len) 
+    key_len = (KEY_BUFFER_LENGTH - 1) - self->key_prefix_len;
+
+  if (self->key_prefix_len > 0)
+    strncpy(key_buffer, self->key_prefix, self->key_prefix_len);
+
+  strncpy(key_buffer + self->key_prefix_len, key_start, key_len);
+  key_buffer[key_len + self->key_prefix_len] = '\0'; 
+}
+
+static void
+grok_instance_prepare_captures(GrokInstance *self)
+{
+  const grok_capture *gct;
+  char key_buffer[KEY_BUFFER_LENGTH];
+
+  self->captures = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  grok_capture_walk_init(self->grok);
+  while ((gct = grok_capture_walk_next(self->grok)) != NULL)
+    {
+      GrokCapture *capture = g_new0(GrokCapture, 1);
+
+      _split_and_add_key_prefix(self, key_buffer, gct->name, gct->name_len, &capture->type);
+      capture->handle = log_msg_get_value_handle(key_buffer);
+      g_hash_table_insert(self->captures, g_strndup(gct->name, gct->name_len), capture);
+    }
+  grok_capture_walk_end(self->grok);
+}
+
+/*
+ * Literal prefilter
+ *
+ * Extracts the longest literal substring every match of the expanded regex
+ * has to contain, so messages lacking it can be rejected with a substring
+ * search instead of running the regex. The analysis is conservative: groups
+ * that are optional or contain alternation are not looked into, and anything
+ * not understood simply ends the current literal.
+ */
+
+static void
+_literal_scan_finish_run(GString *current, GString *best)
+{
+  if (current->len > best->len)
+    g_string_assign(best, current->str);
+  g_string_truncate(current, 0);
+}
+
+/* skips POSIX classes, collating elements and equivalence classes, e.g. [:digit:] */
+static gint
+_literal_scan_skip_posix_class(const char *re, gint i, gint end)
+{
+  gchar delimiter = re[i + 1];
+
+  for (i += 2; i + 1 < end; i++)
+    {
+      if (re[i] == delimiter && re[i + 1] == ']')
+        return i + 2;
+    }
+  return end;
+}
+
+static gint
+_literal_scan_skip_char_class(const char *re, gint i, gint end)
+{
+  i++;
+  if (i < end && re[i] == '^')
+    i++;
+  if (i < end && re[i] == ']')
+    i++;
+  while (i < end && re[i] != ']')
+    {
+      if (re[i] == '[' && i + 1 < end && strchr(":=.", re[i + 1]))
+        {
+          i = _literal_scan_skip_posix_class(re, i, end);
+          continue;
+        }
+      if (re[i] == '\\')
+        i++;
+      i++;
+    }
+  return i + 1;
+}
+
+static gint
+_literal_scan_find_group_end(const char *re, gint i, gint end)
+{
+  gint depth = 0;
+
+  while (i < end)
+    {
+      switch (re[i])
+        {
+        case '\\':
+          i += 2;
+          continue;
+        case '[':
+          i = _literal_scan_skip_char_class(re, i, end);
+          continue;
+        case '(':
+          depth++;
+          break;
+        case ')':
+          if (--depth == 0)
+            return i;
+          break;
+        }
+      i++;
+    }
+  return -1;
+}
+
+static gint
+_literal_scan_skip_quantifier(const char *re, gint i, gint end, gboolean *optional, gboolean *repeated)
+{
+  *optional = FALSE;
+  *repeated = FALSE;
+
+  if (i >= end)
+    return i;
+
+  switch (re[i])
+    {
+    case '?':
+    case '*':
+      *optional = TRUE;
+      i++;
+      break;
+    case '+':
+      *repeated = TRUE;
+      i++;
+      break;
+    case '{':
+      if (i + 1 >= end || !g_ascii_isdigit(re[i + 1]))
+        return i;
+      *optional = (atoi(re + i + 1) == 0);
+      *repeated = TRUE;
+      while (i < end && re[i] != '}')
+        i++;
+      i++;
+      break;
+    default:
+      return i;
+    }
+
+  /* lazy and possessive modifiers */
+  if (i < end && (re[i] == '?' || re[i] == '+'))
+    i++;
+  return i;
+}
+
+static gboolean _literal_scan_sequence(const char *re, gint start, gint end, GString *best);
+
+static void
+_literal_scan_group(const char *re, gint open, gint close, GString *best)
+{
+  gint content = open + 1;
+
+  /* backtracking control verbs and start of pattern options, e.g. (*UCP) */
+  if (re[content] == '*')
+    return;
+
+  if (re[content] == '?')
+    {
+      const char *name_end = NULL;
+
+      if (re[content + 1] == ':' || re[content + 1] == '>')
+        content += 2;
+      else if (re[content + 1] == '<' && re[content + 2] != '=' && re[content + 2] != '!')
+        name_end = memchr(re + content, '>', close - content);
+      else if (re[content + 1] == 'P' && re[content + 2] == '<')
+        name_end = memchr(re + content, '>', close - content);
+      else if (re[content + 1] == '\'')
+        name_end = memchr(re + content + 2, '\'', close - content - 2);
+      else
+        /* lookarounds, option settings, comments */
+        return;
+
+      if (name_end)
+        content = name_end - re + 1;
+      else if (content == open + 1)
+        return;
+    }
+
+  _literal_scan_sequence(re, content, close, best);
+}
+
+static gboolean
+_literal_scan_sequence(const char *re, gint start, gint end, GString *best)
+{
+  GString *current = g_string_sized_new(32);
+  GString *local_best = g_string_sized_new(32);
+  gboolean optional, repeated;
+  gboolean result = TRUE;
+  gint i = start;
+
+  while (i < end)
+    {
+      gchar literal;
+      gint next;
+
+      switch (re[i])
+        {
+        case '|':
+          result = FALSE;
+          goto exit;
+        case '(':
+          {
+            gint close = _literal_scan_find_group_end(re, i, end);
+
+            if (close < 0)
+              {
+                result = FALSE;
+                goto exit;
+              }
+            _literal_scan_finish_run(current, local_best);
+            next = _literal_scan_skip_quantifier(re, close + 1, end, &optional, &repeated);
+            if (!optional)
+              _literal_scan_group(re, i, close, local_best);
+            i = next;
+            continue;
+          }
+        case '[':
+          _literal_scan_finish_run(current, local_best);
+          next = _literal_scan_skip_char_class(re, i, end);
+          i = _literal_scan_skip_quantifier(re, next, end, &optional, &repeated);
+          continue;
+        case '\\':
+          if (i + 1 >= end || g_ascii_isalnum(re[i + 1]))
+            {
+              /* character types, assertions, back references */
+              _literal_scan_finish_run(current, local_best);
+              i = _literal_scan_skip_quantifier(re, i + 2, end, &optional, &repeated);
+              continue;
+            }
+          literal = re[i + 1];
+          next = i + 2;
+          break;
+        case '{':
+          if (i + 1 < end && g_ascii_isdigit(re[i + 1]))
+            {
+              _literal_scan_finish_run(current, local_best);
+              i = _literal_scan_skip_quantifier(re, i, end, &optional, &repeated);
+              continue;
+            }
+          literal = re[i];
+          next = i + 1;
+          break;
+        case '.':
+        case '^':
+        case '$':
+        case '?':
+        case '*':
+        case '+':
+        case ')':
+          _literal_scan_finish_run(current, local_best);
+          i++;
+          continue;
+        default:
+          literal = re[i];
+          next = i + 1;
+          break;
+        }
+
+      i = _literal_scan_skip_quantifier(re, next, end, &optional, &repeated);
+      if (optional)
+        {
+          _literal_scan_finish_run(current, local_best);
+          continue;
+        }
+      g_string_append_c(current, literal);
+      if (repeated)
+        _literal_scan_finish_run(current, local_best);
+    }
+
+  _literal_scan_finish_run(current, local_best);
+  if (local_best->len > best->len)
+    g_string_assign(best, local_best->str);
+
+ exit:
+  g_string_free(current, TRUE);
+  g_string_free(local_best, TRUE);
+  return result;
+}
+
+/* option settings anywhere in an inline flag group, e.g. (?i), (?mi) or
+ * (?s-x:...), change how the literal text of the pattern matches */
+static gboolean
+_literal_scan_has_inline_option(const char *re, const char *options)
+{
+  const char *group;
+
+  for (group = strstr(re, "(?"); group; group = strstr(group + 2, "(?"))
+    {
+      const char *p = group + 2;
+      gboolean found = FALSE;
+
+      while (g_ascii_isalpha(*p) || *p == '-' || *p == '^')
+        {
+          if (strchr(options, *p))
+            found = TRUE;
+          p++;
+        }
+      if (found && (*p == ')' || *p == ':'))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static char *
+grok_extract_required_literal(const char *regex, gint regex_len)
+{
+  GString *best;
+
+  if (!regex || _literal_scan_has_inline_option(regex, "ix") || strstr(regex, "\\Q"))
+    return NULL;
+
+  best = g_string_sized_new(32);
+  if (!_literal_scan_sequence(regex, 0, regex_len, best) ||
+      best->len < GROK_PREFILTER_MIN_LITERAL_LEN)
+    {
+      g_string_free(best, TRUE);
+      return NULL;
+    }
+  return g_string_free(best, FALSE);
+}
+
 static gboolean 
 grok_instance_init(GrokInstance *self, GrokParser *parser)
 {
@@ -165,30 +582,97 @@ grok_instance_init(GrokInstance *self, GrokParser *parser)
   self->key_prefix = parser->key_prefix;
   self->key_prefix_len = parser->key_prefix_len;
 
+  grok_instance_prepare_captures(self);
+
+  self->required_literal = grok_extract_required_literal(self->grok->full_pattern, self->grok->full_pattern_len);
+  if (self->required_literal)
+    msg_debug("Grok pattern prefiltered by literal",
+              evt_tag_str("pattern", self->grok_pattern),
+              evt_tag_str("literal", self->required_literal),
+              NULL);
+
   return TRUE;
 };
 
-static void
-_split_and_add_key_prefix(GrokInstance *self, char *key_buffer, char *key, int key_len)
+/* converts typed captures (eg. %{NUMBER:bytes:int}) to their canonical
+ * form, values that cannot be converted are not stored at all */
+static gboolean
+grok_capture_format_typed_value(GrokCapture *capture, const char *value, char *buffer, gsize buffer_len)
 {
-  char *key_start = strchr(key, ':');
+  switch (capture->type)
+    {
+    case TYPE_HINT_INT32:
+      {
+        gint32 i;
+
+        if (!type_cast_to_int32(value, &i, NULL))
+          return FALSE;
+        g_snprintf(buffer, buffer_len, "%d", i);
+        return TRUE;
+      }
+    case TYPE_HINT_INT64:
+      {
+        gint64 i;
+
+        if (!type_cast_to_int64(value, &i, NULL))
+          return FALSE;
+        g_snprintf(buffer, buffer_len, "%" G_GINT64_FORMAT, i);
+        return TRUE;
+      }
+    case TYPE_HINT_DOUBLE:
+      {
+        gdouble d;
+
+        if (!type_cast_to_double(value, &d, NULL))
+          return FALSE;
+        g_ascii_dtostr(buffer, buffer_len, d);
+        return TRUE;
+      }
+    case TYPE_HINT_BOOLEAN:
+      {
+        gboolean b;
+
+        if (!type_cast_to_boolean(value, &b, NULL))
+          return FALSE;
+        g_strlcpy(buffer, b ? "true" : "false", buffer_len);
+        return TRUE;
+      }
+    default:
+      g_assert_not_reached();
+    }
+  return FALSE;
+}
 
-  if (key_start == NULL)
-    key_start = key;
-  else
-   {
-     key_start = key_start + 1;
-     key_len = key_len - (key_start - key);
-   }
+static gboolean
+_type_needs_conversion(TypeHint type)
+{
+  return type == TYPE_HINT_INT32 || type == TYPE_HINT_INT64 ||
+         type == TYPE_HINT_DOUBLE || type == TYPE_HINT_BOOLEAN;
+}
 
-  if (key_len > (KEY_BUFFER_LENGTH - 1) - self->key_prefix_len) 
-    key_len = (KEY_BUFFER_LENGTH - 1) - self->key_prefix_len;
+static void
+grok_capture_set_value(GrokCapture *capture, LogMessage *msg, const char *value, int value_len)
+{
+  char value_buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  char *value_str;
+  gboolean converted;
 
-  if (self->key_prefix_len > 0)
-    strncpy(key_buffer, self->key_prefix, self->key_prefix_len);
+  if (!_type_needs_conversion(capture->type))
+    {
+      log_msg_set_value(msg, capture->handle, value, value_len);
+      return;
+    }
 
-  strncpy(key_buffer + self->key_prefix_len, key_start, key_len);
-  key_buffer[key_len + self->key_prefix_len] = '\0'; 
+  value_str = g_strndup(value, value_len);
+  converted = grok_capture_format_typed_value(capture, value_str, value_buffer, sizeof(value_buffer));
+  if (converted)
+    log_msg_set_value(msg, capture->handle, value_buffer, -1);
+  else
+    msg_debug("Grok capture cannot be converted to the requested type, ignoring",
+              evt_tag_str("name", log_msg_get_value_name(capture->handle, NULL)),
+              evt_tag_str("value", value_str),
+              NULL);
+  g_free(value_str);
 }
 
 static void 
@@ -196,15 +680,14 @@ grok_instance_add_matched_values_to_msg(GrokInstance *self, grok_match_t *match,
 {
   char *key, *value;
   int key_len, value_len;
-  char key_buffer[KEY_BUFFER_LENGTH];
 
   grok_match_walk_init(match);
   while (grok_match_walk_next(match, &key, &key_len, (const char**) &value, &value_len) == 0)
     {
-      _split_and_add_key_prefix(self, key_buffer, key, key_len);
+      GrokCapture *capture = g_hash_table_lookup(self->captures, key);
 
-      NVHandle handle = log_msg_get_value_handle(key_buffer);
-      log_msg_set_value(msg, handle, value, value_len);
+      if (capture)
+        grok_capture_set_value(capture, msg, value, value_len);
     }
   grok_match_walk_end(match);
 }
@@ -229,6 +712,13 @@ grok_instance_match(GrokInstance *self, char* text, LogMessage *msg)
 {
   grok_match_t match;
 
+  /* strstr() is vectorized in glibc, much cheaper than a failing regex */
+  if (self->required_literal && !strstr(text, self->required_literal))
+    {
+      msg_debug("Grok pattern not matched, required literal missing!", NULL);
+      return FALSE;
+    }
+
   int grok_res = grok_exec(self->grok, text, &match);
   if (grok_res == GROK_OK)
     {
@@ -248,25 +738,6 @@ grok_instance_match(GrokInstance *self, char* text, LogMessage *msg)
   return FALSE;
 };
 
-static gboolean 
-grok_parser_init(LogPipe *parser)
-{
-  GrokParser *self = (GrokParser *)parser;
-  GlobalConfig *cfg = log_pipe_get_config(&self->super.super); 
-
-  if (self->key_prefix != NULL)
-    self->key_prefix_len = strlen(self->key_prefix);
-
-  if (!self->template)
-  {
-    self->template = log_template_new(cfg, "default_grok_template");
-    log_template_compile(self->template, "$MESSAGE", NULL);
-  }
-
-  g_list_foreach(self->instances, (GFunc) grok_instance_init, self);
-  return TRUE;
-};
-
 void
 grok_parser_set_pattern_directory(LogParser *s, gchar *pattern_directory)
 {
@@ -286,30 +757,6 @@ grok_parser_add_pattern_instance(LogParser *s, GrokInstance *instance)
   self->instances = g_list_append(self->instances, instance);
 };
 
-static gboolean 
-grok_parser_process(LogParser *s, LogMessage **pmsg, const LogPathOptions *path_options, const char *input, gsize input_len)
-{
-  LogMessage *msg = *pmsg;
-  GString *str;
-  GList *instance;
-  LogTemplateOptions template_options;
- 
-  GrokParser *self = (GrokParser *)s;
-  str = g_string_new("");
-  log_template_options_defaults(&template_options);
-
-  log_template_format(self->template, msg, &template_options, 0, 0, NULL, str);
-
-  instance = self->instances;
-  while (instance && !(grok_instance_match(instance->data, str->str, msg)))
-    { 
-      instance = instance->next;
-    }
-
-  g_string_free(str, TRUE);
-  return TRUE;
-};
-
 static GList* _clone_list(GList* list, gpointer(*item_cloner)(gpointer));
 
 static gpointer
@@ -360,6 +807,383 @@ grok_parser_clone_custom_patterns(GrokParser *self)
   return _clone_list(self->custom_patterns, grok_custom_pattern_clone);
 };
 
+static void
+grok_pattern_set_unref(GrokPatternSet *self)
+{
+  if (!g_atomic_int_dec_and_test(&self->ref_cnt))
+    return;
+
+  g_list_free_full(self->instances, grok_instance_free);
+  g_free(self);
+}
+
+/* compiles a private copy of the configured instances, the result tells
+ * whether every pattern compiled successfully */
+static GrokPatternSet *
+grok_pattern_set_compile(GrokParser *parser, gboolean *result)
+{
+  GrokPatternSet *self = g_new0(GrokPatternSet, 1);
+  GList *instances = grok_parser_clone_instances(parser);
+  GList *p;
+
+  self->ref_cnt = 1;
+  *result = TRUE;
+  for (p = instances; p; p = p->next)
+    {
+      if (grok_instance_init(p->data, parser))
+        self->instances = g_list_append(self->instances, p->data);
+      else
+        {
+          grok_instance_free(p->data);
+          *result = FALSE;
+        }
+    }
+  g_list_free(instances);
+  return self;
+}
+
+/* publishes the new set and frees the previous one, no reader can hold it
+ * once the write lock is released */
+static void
+grok_parser_replace_patterns(GrokParser *self, GrokPatternSet *patterns)
+{
+  GrokPatternSet *old_patterns;
+
+  g_rw_lock_writer_lock(&self->patterns_lock);
+  old_patterns = self->patterns;
+  self->patterns = patterns;
+  g_rw_lock_writer_unlock(&self->patterns_lock);
+
+  if (old_patterns)
+    grok_pattern_set_unref(old_patterns);
+}
+
+static void
+grok_parser_reload_work(gpointer s)
+{
+  GrokParser *self = (GrokParser *)s;
+  gboolean success;
+
+  self->reloaded_patterns = grok_pattern_set_compile(self, &success);
+  if (!success)
+    {
+      grok_pattern_set_unref(self->reloaded_patterns);
+      self->reloaded_patterns = NULL;
+    }
+}
+
+static void grok_parser_schedule_reload(GrokParser *self);
+
+static void
+grok_parser_reload_completion(gpointer s)
+{
+  GrokParser *self = (GrokParser *)s;
+  GrokPatternSet *patterns = self->reloaded_patterns;
+
+  main_loop_assert_main_thread();
+
+  self->reloaded_patterns = NULL;
+  if (!self->watching)
+    {
+      if (patterns)
+        grok_pattern_set_unref(patterns);
+      return;
+    }
+
+  if (patterns)
+    {
+      msg_info("Grok pattern directory reloaded",
+               evt_tag_str("pattern_dir", self->grok_pattern_dir),
+               NULL);
+      grok_parser_replace_patterns(self, patterns);
+    }
+  else
+    {
+      msg_error("Error recompiling grok patterns after a pattern directory change, keeping the current patterns",
+                evt_tag_str("pattern_dir", self->grok_pattern_dir),
+                NULL);
+    }
+
+  if (self->reload_pending)
+    {
+      self->reload_pending = FALSE;
+      grok_parser_schedule_reload(self);
+    }
+}
+
+static void
+grok_parser_reload_timer_expired(gpointer s)
+{
+  GrokParser *self = (GrokParser *)s;
+
+  if (self->reload_job.working)
+    {
+      self->reload_pending = TRUE;
+      return;
+    }
+  main_loop_io_worker_job_submit(&self->reload_job);
+}
+
+static void
+grok_parser_schedule_reload(GrokParser *self)
+{
+  if (iv_timer_registered(&self->reload_timer))
+    iv_timer_unregister(&self->reload_timer);
+
+  iv_validate_now();
+  self->reload_timer.expires = iv_now;
+  self->reload_timer.expires.tv_sec += GROK_PATTERN_RELOAD_DELAY;
+  iv_timer_register(&self->reload_timer);
+}
+
+#if SYSLOG_NG_HAVE_INOTIFY
+
+static void
+grok_parser_pattern_dir_changed(void *s, struct inotify_event *event)
+{
+  GrokParser *self = (GrokParser *)s;
+
+  msg_debug("Grok pattern directory changed, scheduling reload",
+            evt_tag_str("pattern_dir", self->grok_pattern_dir),
+            evt_tag_str("filename", event->len ? event->name : ""),
+            NULL);
+  grok_parser_schedule_reload(self);
+}
+
+static gboolean
+grok_parser_start_watching(GrokParser *self)
+{
+  IV_INOTIFY_INIT(&self->inotify);
+  if (iv_inotify_register(&self->inotify) != 0)
+    return FALSE;
+
+  IV_INOTIFY_WATCH_INIT(&self->pattern_dir_watch);
+  self->pattern_dir_watch.inotify = &self->inotify;
+  self->pattern_dir_watch.pathname = self->grok_pattern_dir;
+  self->pattern_dir_watch.mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  self->pattern_dir_watch.cookie = self;
+  self->pattern_dir_watch.handler = grok_parser_pattern_dir_changed;
+  if (iv_inotify_watch_register(&self->pattern_dir_watch) != 0)
+    {
+      iv_inotify_unregister(&self->inotify);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+grok_parser_stop_watching(GrokParser *self)
+{
+  iv_inotify_watch_unregister(&self->pattern_dir_watch);
+  iv_inotify_unregister(&self->inotify);
+}
+
+#else
+
+static gboolean
+grok_parser_start_watching(GrokParser *self)
+{
+  return FALSE;
+}
+
+static void
+grok_parser_stop_watching(GrokParser *self)
+{
+}
+
+#endif
+
+static void
+grok_parser_init_watches(GrokParser *self)
+{
+  IV_TIMER_INIT(&self->reload_timer);
+  self->reload_timer.cookie = self;
+  self->reload_timer.handler = grok_parser_reload_timer_expired;
+
+  main_loop_io_worker_job_init(&self->reload_job);
+  self->reload_job.user_data = self;
+  self->reload_job.work = grok_parser_reload_work;
+  self->reload_job.completion = grok_parser_reload_completion;
+  self->reload_job.engage = (void (*)(gpointer)) log_pipe_ref;
+  self->reload_job.release = (void (*)(gpointer)) log_pipe_unref;
+}
+
+static void
+grok_parser_start_watches(GrokParser *self)
+{
+  if (!self->watch_pattern_dir || !self->grok_pattern_dir)
+    return;
+
+  if (!grok_parser_start_watching(self))
+    {
+      msg_warning("Cannot watch grok pattern directory, changes will only be picked up on reload",
+                  evt_tag_str("pattern_dir", self->grok_pattern_dir),
+                  NULL);
+      return;
+    }
+  self->watching = TRUE;
+}
+
+static void
+grok_parser_stop_watches(GrokParser *self)
+{
+  if (!self->watching)
+    return;
+
+  if (iv_timer_registered(&self->reload_timer))
+    iv_timer_unregister(&self->reload_timer);
+  grok_parser_stop_watching(self);
+  self->reload_pending = FALSE;
+  self->watching = FALSE;
+}
+
+static gboolean 
+grok_parser_init(LogPipe *parser)
+{
+  GrokParser *self = (GrokParser *)parser;
+  GlobalConfig *cfg = log_pipe_get_config(&self->super.super); 
+  gboolean success;
+
+  if (self->key_prefix != NULL)
+    self->key_prefix_len = strlen(self->key_prefix);
+
+  if (!self->template)
+  {
+    self->template = log_template_new(cfg, "default_grok_template");
+    log_template_compile(self->template, "$MESSAGE", NULL);
+  }
+
+  grok_parser_replace_patterns(self, grok_pattern_set_compile(self, &success));
+  grok_parser_start_watches(self);
+  return TRUE;
+};
+
+static gboolean
+grok_parser_deinit(LogPipe *parser)
+{
+  GrokParser *self = (GrokParser *)parser;
+
+  grok_parser_stop_watches(self);
+  return TRUE;
+}
+
+static void
+grok_parser_match_message(GrokParser *self, GrokPatternSet *patterns, LogMessage *msg, GString *str)
+{
+  GList *instance;
+  LogTemplateOptions template_options;
+
+  log_template_options_defaults(&template_options);
+
+  g_string_truncate(str, 0);
+  log_template_format(self->template, msg, &template_options, 0, 0, NULL, str);
+
+  instance = patterns->instances;
+  while (instance && !(grok_instance_match(instance->data, str->str, msg)))
+    { 
+      instance = instance->next;
+    }
+}
+
+static gboolean 
+grok_parser_process(LogParser *s, LogMessage **pmsg, const LogPathOptions *path_options, const char *input, gsize input_len)
+{
+  LogMessage *msg = *pmsg;
+  GString *str;
+ 
+  GrokParser *self = (GrokParser *)s;
+  str = g_string_new("");
+
+  g_rw_lock_reader_lock(&self->patterns_lock);
+  grok_parser_match_message(self, self->patterns, msg, str);
+  g_rw_lock_reader_unlock(&self->patterns_lock);
+
+  g_string_free(str, TRUE);
+  return TRUE;
+};
+
+typedef struct _GrokBatchWorker
+{
+  GrokParser *parser;
+  GrokPatternSet *patterns;
+  LogMessage **msgs;
+  gsize num_msgs;
+} GrokBatchWorker;
+
+static gpointer
+grok_batch_worker_run(gpointer s)
+{
+  GrokBatchWorker *self = (GrokBatchWorker *)s;
+  GString *str = g_string_sized_new(256);
+  gsize i;
+
+  for (i = 0; i < self->num_msgs; i++)
+    grok_parser_match_message(self->parser, self->patterns, self->msgs[i], str);
+
+  g_string_free(str, TRUE);
+  return NULL;
+}
+
+/* libgrok keeps the state of the last match in grok_t, so compiled patterns
+ * cannot be shared between threads: every worker compiles its own copy of
+ * the current configuration. */
+gboolean
+grok_parser_process_batch(LogParser *s, LogMessage **msgs, gsize num_msgs, gint num_workers)
+{
+  GrokParser *self = (GrokParser *)s;
+  GrokBatchWorker *workers;
+  GThread **threads;
+  gsize chunk_size, offset = 0;
+  gboolean success = TRUE;
+  gint i;
+
+  if (num_msgs == 0)
+    return TRUE;
+
+  if (num_workers < 1)
+    num_workers = 1;
+  if ((gsize) num_workers > num_msgs)
+    num_workers = num_msgs;
+
+  chunk_size = (num_msgs + num_workers - 1) / num_workers;
+  workers = g_new0(GrokBatchWorker, num_workers);
+  threads = g_new0(GThread *, num_workers);
+
+  for (i = 0; i < num_workers; i++)
+    {
+      gboolean compiled;
+
+      workers[i].parser = self;
+      workers[i].msgs = msgs + offset;
+      workers[i].num_msgs = MIN(chunk_size, num_msgs - offset);
+      workers[i].patterns = grok_pattern_set_compile(self, &compiled);
+      offset += workers[i].num_msgs;
+      success &= compiled;
+    }
+
+  if (!success)
+    {
+      msg_error("Error compiling grok patterns for batch processing",
+                NULL);
+      goto exit;
+    }
+
+  for (i = 1; i < num_workers; i++)
+    threads[i] = g_thread_new("grok-batch", grok_batch_worker_run, &workers[i]);
+
+  grok_batch_worker_run(&workers[0]);
+
+  for (i = 1; i < num_workers; i++)
+    g_thread_join(threads[i]);
+
+ exit:
+  for (i = 0; i < num_workers; i++)
+    grok_pattern_set_unref(workers[i].patterns);
+  g_free(threads);
+  g_free(workers);
+  return success;
+}
+
 
 static LogPipe *
 grok_parser_clone(LogPipe *s)
@@ -376,6 +1200,7 @@ grok_parser_clone(LogPipe *s)
   cloned->key_prefix_len = self->key_prefix_len;
   
   cloned->grok_pattern_dir = g_strdup(self->grok_pattern_dir);
+  cloned->watch_pattern_dir = self->watch_pattern_dir;
   return &cloned->super.super;
 };
 
@@ -400,6 +1225,10 @@ grok_parser_free(LogPipe *s)
 
   log_template_unref(self->template);
 
+  if (self->patterns)
+    grok_pattern_set_unref(self->patterns);
+  g_rw_lock_clear(&self->patterns_lock);
+
   g_free(self->grok_pattern_dir);
   log_parser_free_method(s);
 };
@@ -408,7 +1237,10 @@ LogParser *grok_parser_new(GlobalConfig *cfg)
 {
   GrokParser *self = g_new0(GrokParser, 1);
   log_parser_init_instance(&self->super, cfg);
+  g_rw_lock_init(&self->patterns_lock);
+  grok_parser_init_watches(self);
   self->super.super.init = grok_parser_init;
+  self->super.super.deinit = grok_parser_deinit;
   self->super.process = grok_parser_process;
   self->super.super.clone = grok_parser_clone;
   self->super.super.free_fn = grok_parser_free;
@@ -35,7 +35,13 @@ void grok_instance_set_pattern (GrokInstance *s, gchar *pattern);
 void grok_instance_add_tags (GrokInstance *s, GList *tags);
 void grok_parser_add_named_subpattern(LogParser *self, const char *name, const char *pattern);
 void grok_parser_set_pattern_directory(LogParser *s, gchar *pattern_directory);
+void grok_parser_set_watch_pattern_directory(LogParser *s, gboolean watch);
 void grok_parser_set_key_prefix(LogParser *s, gchar *key_prefix);
 void grok_parser_add_pattern_instance(LogParser *s, GrokInstance *instance);
 void grok_parser_turn_on_debug(LogParser *s);
+
+/* Matches a vector of messages in parallel on num_workers threads, the
+ * parser has to be initialized and the messages writable. Meant for offline
+ * re-parsing of archived logs. */
+gboolean grok_parser_process_batch(LogParser *s, LogMessage **msgs, gsize num_msgs, gint num_workers);
 #endif
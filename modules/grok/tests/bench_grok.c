@@ -0,0 +1,227 @@
+#include "modules/grok/grok-parser.h"
+#include <apphook.h>
+#include <libtest/testutils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef GROK_BENCH_DATA_DIR
+#define GROK_BENCH_DATA_DIR "modules/grok/tests"
+#endif
+
+#define GROK_BENCH_DEFAULT_ITERATIONS 1
+
+typedef struct _BenchPattern
+{
+  const gchar *pattern;
+  gint expected_matches;
+} BenchPattern;
+
+typedef struct _BenchFormat
+{
+  const gchar *name;
+  const gchar *corpus;
+  const gchar *key;
+  BenchPattern patterns[8];
+} BenchFormat;
+
+static BenchFormat bench_formats[] =
+{
+  {
+    "apache", "apache.log", "clientip",
+    {
+      { "%{COMBINEDAPACHELOG}", 12 },
+      { NULL }
+    }
+  },
+  {
+    "nginx", "nginx.log", "clientip",
+    {
+      { "%{NGINXACCESS}", 10 },
+      { NULL }
+    }
+  },
+  {
+    "sshd", "sshd.log", "user",
+    {
+      { "%{SYSLOGBASE} Accepted %{WORD:auth_method} for %{USERNAME:user} from %{IP:src_ip} port %{INT:src_port} ssh2", 3 },
+      { "%{SYSLOGBASE} Failed %{WORD:auth_method} for (?:invalid user )?%{USERNAME:user} from %{IP:src_ip} port %{INT:src_port} ssh2", 4 },
+      { "%{SYSLOGBASE} Invalid user %{USERNAME:user} from %{IP:src_ip} port %{INT:src_port}", 1 },
+      { "%{SYSLOGBASE} pam_unix\\(sshd:session\\): session %{WORD:session_action} for user %{USERNAME:user}", 2 },
+      { NULL }
+    }
+  },
+  {
+    "firewall", "firewall.log", "src_ip",
+    {
+      { "%{IPTABLES}", 10 },
+      { NULL }
+    }
+  },
+  { NULL }
+};
+
+static GPtrArray *
+load_corpus(const gchar *name)
+{
+  GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+  gchar *filename = g_build_filename(GROK_BENCH_DATA_DIR, "corpus", name, NULL);
+  gchar *contents;
+  gchar **split;
+  GError *error = NULL;
+  gint i;
+
+  if (!g_file_get_contents(filename, &contents, NULL, &error))
+    {
+      fprintf(stderr, "Cannot read corpus file: %s\n", error->message);
+      exit(1);
+    }
+
+  split = g_strsplit(contents, "\n", -1);
+  for (i = 0; split[i]; i++)
+    {
+      if (split[i][0] != '\0')
+        g_ptr_array_add(lines, g_strdup(split[i]));
+    }
+
+  g_strfreev(split);
+  g_free(contents);
+  g_free(filename);
+  return lines;
+}
+
+static LogParser *
+create_bench_parser(const gchar *pattern)
+{
+  GlobalConfig *cfg = cfg_new(0x0);
+  LogParser *parser = grok_parser_new(cfg);
+  gchar *pattern_dir = g_build_filename(GROK_BENCH_DATA_DIR, "patterns", NULL);
+  GrokInstance *instance = grok_instance_new();
+
+  grok_parser_set_pattern_directory(parser, pattern_dir);
+  grok_parser_add_named_subpattern(parser, "NGINXACCESS",
+                                   "%{IPORHOST:clientip} - %{USER:auth} \\[%{HTTPDATE:timestamp}\\] "
+                                   "\"%{WORD:verb} %{URIPATHPARAM:request} HTTP/%{NUMBER:httpversion}\" "
+                                   "%{INT:response} %{INT:bytes} %{QS:referrer} %{QS:agent} %{NUMBER:request_time}");
+  grok_parser_add_named_subpattern(parser, "IPTABLES",
+                                   "%{SYSLOGBASE} \\[%{NUMBER:uptime}\\] %{WORD:action} "
+                                   "IN=%{WORD:in_iface}? OUT=%{WORD:out_iface}? (?:MAC=%{NOTSPACE:mac} )?"
+                                   "SRC=%{IP:src_ip} DST=%{IP:dst_ip} LEN=%{INT:len} %{GREEDYDATA} "
+                                   "PROTO=%{WORD:proto}(?: SPT=%{INT:src_port} DPT=%{INT:dst_port})?");
+
+  grok_instance_set_pattern(instance, (gchar *) pattern);
+  grok_parser_add_pattern_instance(parser, instance);
+  g_free(pattern_dir);
+
+  if (!log_pipe_init(&parser->super))
+    {
+      fprintf(stderr, "Cannot initialize grok parser, pattern='%s'\n", pattern);
+      exit(1);
+    }
+  return parser;
+}
+
+static gboolean
+parse_line(LogParser *parser, const gchar *line, NVHandle key)
+{
+  LogPathOptions path_options = LOG_PATH_OPTIONS_INIT;
+  LogMessage *msg = log_msg_new_empty();
+  gssize value_len = 0;
+  gboolean matched;
+
+  log_msg_set_value(msg, LM_V_MESSAGE, line, -1);
+  log_parser_process(parser, &msg, &path_options, NULL, 0);
+  log_msg_get_value(msg, key, &value_len);
+  matched = value_len > 0;
+
+  log_msg_unref(msg);
+  return matched;
+}
+
+static gboolean
+bench_pattern(BenchFormat *format, BenchPattern *pattern, GPtrArray *corpus, gint iterations)
+{
+  LogParser *parser = create_bench_parser(pattern->pattern);
+  NVHandle key = log_msg_get_value_handle(format->key);
+  GTimer *timer = g_timer_new();
+  gint matches = 0;
+  gint i;
+  guint j;
+  gdouble elapsed;
+
+  for (j = 0; j < corpus->len; j++)
+    {
+      if (parse_line(parser, g_ptr_array_index(corpus, j), key))
+        matches++;
+    }
+
+  g_timer_start(timer);
+  for (i = 0; i < iterations; i++)
+    for (j = 0; j < corpus->len; j++)
+      parse_line(parser, g_ptr_array_index(corpus, j), key);
+  g_timer_stop(timer);
+
+  elapsed = g_timer_elapsed(timer, NULL);
+  printf("%-10s %10.0f msg/s %10.0f ns/msg    %2d/%-2u matched  %s\n",
+         format->name,
+         (iterations * corpus->len) / elapsed,
+         (elapsed * 1e9) / (iterations * corpus->len),
+         matches, corpus->len,
+         pattern->pattern);
+
+  g_timer_destroy(timer);
+  log_pipe_deinit(&parser->super);
+  log_pipe_unref(&parser->super);
+
+  if (matches != pattern->expected_matches)
+    {
+      fprintf(stderr, "Grok match count regression; format='%s', pattern='%s', matched='%d', expected='%d'\n",
+              format->name, pattern->pattern, matches, pattern->expected_matches);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+bench_format(BenchFormat *format, gint iterations)
+{
+  GPtrArray *corpus = load_corpus(format->corpus);
+  BenchPattern *pattern;
+  gboolean success = TRUE;
+
+  for (pattern = format->patterns; pattern->pattern; pattern++)
+    success &= bench_pattern(format, pattern, corpus, iterations);
+
+  g_ptr_array_free(corpus, TRUE);
+  return success;
+}
+
+static gint
+get_iterations(int argc, char *argv[])
+{
+  const gchar *value = NULL;
+
+  if (argc > 1)
+    value = argv[1];
+  else
+    value = getenv("GROK_BENCH_ITERATIONS");
+
+  if (!value || atoi(value) <= 0)
+    return GROK_BENCH_DEFAULT_ITERATIONS;
+  return atoi(value);
+}
+
+int main(int argc, char *argv[])
+{
+  BenchFormat *format;
+  gboolean success = TRUE;
+  gint iterations = get_iterations(argc, argv);
+
+  app_startup();
+  printf("grok parser benchmark, iterations=%d\n", iterations);
+  for (format = bench_formats; format->name; format++)
+    success &= bench_format(format, iterations);
+  app_shutdown();
+  return success ? 0 : 1;
+};
@@ -108,12 +108,156 @@ void test_grok_parser_clone()
    log_pipe_unref(&parser->super);
 };
 
+void
+test_grok_typed_capture()
+{
+   LogParser *parser = create_simple_parser();
+   create_and_add_grok_instance_with_pattern(parser, "%{NUMBER:bytes:int}");
+
+   LogMessage *msg = create_message_with_fields("MESSAGE", "0042", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   NVHandle field = log_msg_get_value_handle("bytes");
+   gssize value_len;
+   const gchar *value = log_msg_get_value(msg, field, &value_len);
+
+   assert_nstring(value, value_len, "42", 2, "Typed capture wasn't converted");
+   log_pipe_unref(&parser->super);
+}
+
+void
+test_grok_typed_capture_conversion_failure()
+{
+   LogParser *parser = create_simple_parser();
+   create_and_add_grok_instance_with_pattern(parser, "%{STRING:flag:int}");
+
+   LogMessage *msg = create_message_with_fields("MESSAGE", "value", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   NVHandle field = log_msg_get_value_handle("flag");
+   gssize value_len;
+   log_msg_get_value(msg, field, &value_len);
+
+   assert_gint(value_len, 0, "Unconvertible typed capture was stored");
+   log_pipe_unref(&parser->super);
+}
+
+void
+test_grok_parser_process_batch()
+{
+   LogParser *parser = create_simple_parser();
+   LogMessage *msgs[100];
+   gint i;
+
+   create_and_add_grok_instance_with_pattern(parser, "%{STRING:field}");
+   create_and_add_grok_instance_with_pattern(parser, "%{NUMBER:field2}");
+
+   for (i = 0; i < 100; i++)
+     msgs[i] = create_message_with_fields("MESSAGE", (i % 2) ? "123" : "value", NULL);
+
+   log_pipe_init(&parser->super);
+   assert_true(grok_parser_process_batch(parser, msgs, 100, 4), "Batch processing failed");
+   log_pipe_deinit(&parser->super);
+
+   for (i = 0; i < 100; i++)
+     {
+       NVHandle field = log_msg_get_value_handle((i % 2) ? "field2" : "field");
+       gssize value_len;
+       const gchar *value = log_msg_get_value(msgs[i], field, &value_len);
+
+       if (i % 2)
+         assert_nstring(value, value_len, "123", 3, "Named capture didn't stored in batch");
+       else
+         assert_nstring(value, value_len, "value", 5, "Named capture didn't stored in batch");
+       log_msg_unref(msgs[i]);
+     }
+   log_pipe_unref(&parser->super);
+}
+
+void
+test_grok_literal_prefilter()
+{
+   LogParser *parser = create_simple_parser();
+   create_and_add_grok_instance_with_pattern(parser, "sshd\\[%{NUMBER:pid}\\]");
+   create_and_add_grok_instance_with_pattern(parser, "user %{STRING:user}");
+
+   LogMessage *msg = create_message_with_fields("MESSAGE", "login of user root", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   NVHandle field = log_msg_get_value_handle("user");
+   gssize value_len;
+   const gchar *value = log_msg_get_value(msg, field, &value_len);
+
+   assert_nstring(value, value_len, "root", 4, "Prefiltered pattern didn't match");
+   log_msg_unref(msg);
+
+   msg = create_message_with_fields("MESSAGE", "sshd[42] session opened for root", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   field = log_msg_get_value_handle("pid");
+   value = log_msg_get_value(msg, field, &value_len);
+   assert_nstring(value, value_len, "42", 2, "Prefiltered pattern didn't match");
+
+   field = log_msg_get_value_handle("user");
+   log_msg_get_value(msg, field, &value_len);
+   assert_gint(value_len, 0, "Pattern without its required literal matched");
+   log_msg_unref(msg);
+   log_pipe_unref(&parser->super);
+}
+
+void
+test_grok_literal_prefilter_inline_options()
+{
+   LogParser *parser = create_simple_parser();
+   create_and_add_grok_instance_with_pattern(parser, "(?mi)USER %{STRING:user}");
+
+   LogMessage *msg = create_message_with_fields("MESSAGE", "login of user root", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   NVHandle field = log_msg_get_value_handle("user");
+   gssize value_len;
+   const gchar *value = log_msg_get_value(msg, field, &value_len);
+
+   assert_nstring(value, value_len, "root", 4, "Case-insensitive pattern was filtered out by its literal");
+   log_msg_unref(msg);
+   log_pipe_unref(&parser->super);
+}
+
+void
+test_grok_literal_prefilter_posix_class()
+{
+   LogParser *parser = create_simple_parser();
+   create_and_add_grok_instance_with_pattern(parser, "x%{STRING:word} [[:digit:]]ab");
+
+   LogMessage *msg = create_message_with_fields("MESSAGE", "xfoo 5ab", NULL);
+
+   parse_msg_with_defaults(parser, msg);
+
+   NVHandle field = log_msg_get_value_handle("word");
+   gssize value_len;
+   const gchar *value = log_msg_get_value(msg, field, &value_len);
+
+   assert_nstring(value, value_len, "foo", 3, "Pattern with a POSIX character class didn't match");
+   log_pipe_unref(&parser->super);
+}
+
 int main()
 {
   app_startup();
   test_grok_pattern_single();
   test_grok_pattern_multiple();
   test_grok_parser_clone();
+  test_grok_typed_capture();
+  test_grok_typed_capture_conversion_failure();
+  test_grok_parser_process_batch();
+  test_grok_literal_prefilter();
+  test_grok_literal_prefilter_inline_options();
+  test_grok_literal_prefilter_posix_class();
   app_shutdown();
   return 0;
 };
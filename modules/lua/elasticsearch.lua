@@ -47,8 +47,18 @@ function elastic_request(config, ep, req)
       method = "POST",
       sink = ltn12.sink.table(respbody)
    }
+
+   -- connection errors and 5xx answers are worth retrying later
+   if not result or respcode >= 500 then
+      return syslogng.RETRY
+   end
+   return syslogng.SUCCESS
 end
 
+-- Messages are collected until es_batch_size of them are sent in a single
+-- request: until then they are reported as QUEUED, and the result of the
+-- request applies to all of them
+
 function elastic_queue(msg)
    request = request .. '\n{"create":null}\n' .. msg
    msgcount = msgcount + 1
@@ -57,11 +67,54 @@ function elastic_queue(msg)
       request_len = tostring(#request)
       -- print ("Sending msgs, bytes=" .. request_len .. "; count="..tostring(msgcount))
 
-      elastic_request(config, "/" .. es_index .. "/" .. es_type,
-                      request)
-      request = ""
+      local result = elastic_flush()
+      -- on RETRY the held messages are put back to the queue and are
+      -- passed to elastic_queue() again
+      if result == syslogng.RETRY then
+         request = ""
+      end
+      return result
   end
 
+  return syslogng.QUEUED
+end
+
+-- Set as flush-func(), called when the queue of the destination runs empty
+function elastic_flush()
+   local result = elastic_request(config, "/" .. es_index .. "/" .. es_type,
+                                  request)
+   if result ~= syslogng.RETRY then
+      request = ""
+   end
+   return result
+end
+
+-- Called with an array of formatted messages when batch-func() is set,
+-- so the request is built with a single table.concat()
+function elastic_queue_batch(msgs)
+   return elastic_request(config, "/" .. es_index .. "/" .. es_type,
+                   '{"create":null}\n' .. table.concat(msgs, '\n{"create":null}\n'))
+end
+
+-- Used with async(yes): every call runs in its own coroutine and yields
+-- while the socket is not ready, so up to max-in-flight() requests are
+-- sent at the same time without blocking the destination
+function elastic_queue_async(msg)
+   local status, body = Socket.http_request {
+      host = es_host,
+      port = es_port,
+      method = "POST",
+      path = "/" .. es_index .. "/" .. es_type,
+      headers = { ["Content-Type"] = "application/json" },
+      body = msg
+   }
+
+   if not status then
+      error(body)
+   end
+   if status >= 500 then
+      return syslogng.RETRY
+   end
 end
 
 function elastic_init()
@@ -25,25 +25,101 @@
 #include "lua-dest.h"
 #include "lua-msg.h"
 #include "lua-template.h"
+#include "lua-socket.h"
 #include "lua-utils.h"
+#include "lua-value-pairs.h"
 #include "messages.h"
+#include "timeutils.h"
 #include <lauxlib.h>
 #include <lualib.h>
+#include <iv.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "scratch-buffers.h"
+#include "scanner/list-scanner/list-scanner.h"
+#include "stats/stats-registry.h"
+#include "stats/stats-cluster-logpipe.h"
 
 #define LUA_DEST_MODE_RAW 1
 #define LUA_DEST_MODE_FORMATTED 2
 
+#define LUA_DEST_DEFAULT_BATCH_SIZE 100
+#define LUA_DEST_DEFAULT_MAX_IN_FLIGHT 64
+#define LUA_DEST_DEFAULT_ASYNC_TIMEOUT 30
+#define LUA_DEST_ASYNC_POLL_INTERVAL 10
+
+#define LUA_DEST_GC_INCREMENTAL 1
+#define LUA_DEST_GC_GENERATIONAL 2
+
+#if LUA_VERSION_NUM >= 502
+#define lua_dd_resume(thread, from, nargs) lua_resume(thread, from, nargs)
+#else
+#define lua_dd_resume(thread, from, nargs) lua_resume(thread, nargs)
+#endif
+
 #ifndef SCS_LUA
 #define SCS_LUA 0
 #endif
 
+/* the values of the syslogng.DROP, SUCCESS, RETRY and QUEUED constants */
+typedef enum
+{
+  LUA_DEST_RESULT_DROP = 0,
+  LUA_DEST_RESULT_SUCCESS = 1,
+  LUA_DEST_RESULT_RETRY = 2,
+  LUA_DEST_RESULT_QUEUED = 3
+} LuaDestResult;
+
 typedef struct _LuaGlobalConstant {
    char *name;
    char *value;
    TypeHint type;
 } LuaGlobalConstant;
 
+typedef struct _LuaDestWorker {
+  LuaDestDriver *owner;
+  lua_State *state;
+  GThread *thread;
+  GAsyncQueue *jobs;
+
+  /* registry reference of the reused params table, or LUA_NOREF */
+  int params_table_ref;
+  /* number of pairs in the previous params table, used as a size hint */
+  gint num_params;
+
+  /* bytes allocated by the state, and the limit enforced, 0 if none */
+  gsize memory_used;
+  gsize memory_limit;
+  /* set while the state runs a protected call, see lua_dd_alloc() */
+  gboolean in_protected_call;
+
+  /* the slice of the current round this worker is processing */
+  LogMessage **msgs;
+  guint num_msgs;
+  LuaDestResult *results;
+} LuaDestWorker;
+
+typedef struct _LuaDestAsyncCall {
+  LogMessage *msg;
+  lua_State *thread;
+  int thread_ref;
+
+  /* what the coroutine waits for, fd is -1 if it just yielded */
+  int fd;
+  short events;
+  gint64 deadline;
+  gint attempts;
+  /* when a call the script asked to retry is restarted, 0 if none */
+  gint64 retry_at;
+
+  /* finished calls wait here until every earlier one is finished */
+  gboolean done;
+  gboolean success;
+} LuaDestAsyncCall;
+
 static void
 lua_global_constant_free(LuaGlobalConstant *self)
 {
@@ -53,13 +129,13 @@ lua_global_constant_free(LuaGlobalConstant *self)
 };
 
 static gboolean
-lua_dd_load_file(LuaDestDriver *self)
+lua_dd_load_file(LuaDestDriver *self, lua_State *state)
 {
-  if (luaL_loadfile(self->state, self->filename) ||
-      lua_pcall(self->state, 0,0,0) )
+  if (lua_load_file_cached(state, self->filename) ||
+      lua_pcall(state, 0,0,0) )
     {
       msg_error("Error parsing lua script file for lua destination",
-                evt_tag_str("error", lua_tostring(self->state, -1)),
+                evt_tag_str("error", lua_tostring(state, -1)),
                 evt_tag_str("filename", self->filename),
                 evt_tag_str("driver_id", self->super.super.super.id),
                 NULL);
@@ -68,133 +144,1094 @@ lua_dd_load_file(LuaDestDriver *self)
   return TRUE;
 };
 
-static void lua_dd_accept_message(LogMessage *msg, LogPathOptions *path_options)
+static void
+lua_push_list(lua_State *state, const gchar *value)
 {
-   log_msg_ack(msg, path_options, AT_PROCESSED);
-   log_msg_unref(msg);
-};
+  ListScanner scanner;
+  int i = 0;
 
-static void lua_dd_ack_message(LuaDestDriver *self, LogMessage *msg, LogPathOptions *path_options)
-{
-   lua_dd_accept_message(msg, path_options);
-};
+  lua_newtable(state);
+  list_scanner_init(&scanner);
+  list_scanner_input_string(&scanner, value, -1);
+  while (list_scanner_scan_next(&scanner))
+    {
+      lua_pushlstring(state, list_scanner_get_current_value(&scanner),
+                      list_scanner_get_current_value_len(&scanner));
+      lua_rawseti(state, -2, ++i);
+    }
+  list_scanner_deinit(&scanner);
+}
 
-static void lua_dd_drop_message(LuaDestDriver *self, LogMessage *msg, LogPathOptions *path_options)
-{
-   stats_counter_inc(self->super.dropped_messages);
-   lua_dd_accept_message(msg, path_options);
-};
+#define LUA_DD_MAX_EXACT_INTEGER G_GINT64_CONSTANT(9007199254740992)
 
-static void 
+/*
+ * Pushes the value as a native Lua value according to its type hint.
+ * Datetimes are pushed as seconds since the epoch (with the milliseconds
+ * as fraction), lists as arrays of strings. Values that cannot be cast are
+ * pushed as strings, so the caller always finds one value on the stack.
+ */
+static void
 lua_cast_and_push_value_to_stack(lua_State *state, const gchar *name, TypeHint type, const gchar *value)
 {
+  GError *error = NULL;
+
   switch (type)
     {
     case TYPE_HINT_INT32:
       {
         gint32 i;
 
-        if (type_cast_to_int32(value, &i, NULL))
-          lua_pushinteger(state, i);
-        else
-          msg_error("Cannot cast value to integer",
-                    evt_tag_str("name", name),
-                    evt_tag_str("value", value),
-                    NULL);
+        if (type_cast_to_int32(value, &i, &error))
+          {
+            lua_pushinteger(state, i);
+            return;
+          }
+        break;
+      }
+    case TYPE_HINT_INT64:
+      {
+        gint64 i;
+
+        if (type_cast_to_int64(value, &i, &error))
+          {
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(state, i);
+#else
+            /* a lua_Number only holds integers up to 2^53 exactly */
+            if (i > LUA_DD_MAX_EXACT_INTEGER || i < -LUA_DD_MAX_EXACT_INTEGER)
+              lua_pushstring(state, value);
+            else
+              lua_pushnumber(state, (lua_Number) i);
+#endif
+            return;
+          }
+        break;
+      }
+    case TYPE_HINT_DOUBLE:
+      {
+        gdouble d;
 
+        if (type_cast_to_double(value, &d, &error))
+          {
+            lua_pushnumber(state, d);
+            return;
+          }
         break;
       }
-    case TYPE_HINT_STRING:
-      lua_pushstring(state, value);
-      break;
+    case TYPE_HINT_BOOLEAN:
+      {
+        gboolean b;
+
+        if (type_cast_to_boolean(value, &b, &error))
+          {
+            lua_pushboolean(state, b);
+            return;
+          }
+        break;
+      }
+    case TYPE_HINT_DATETIME:
+      {
+        guint64 msec;
+
+        if (type_cast_to_datetime_int(value, &msec, &error))
+          {
+            lua_pushnumber(state, (lua_Number) msec / 1000);
+            return;
+          }
+        break;
+      }
+    case TYPE_HINT_LIST:
+      lua_push_list(state, value);
+      return;
     default:
-      msg_error("Unsupported type hint (strings or integers only!)",
-                evt_tag_str("name", name),
-                evt_tag_str("value", value),
-                NULL);
-      break;
+      lua_pushstring(state, value);
+      return;
     }
 
-};
+  msg_error("Cannot cast value to the requested type, passing it as string",
+            evt_tag_str("name", name),
+            evt_tag_str("value", value),
+            evt_tag_str("error", error ? error->message : "unknown"),
+            NULL);
+  if (error)
+    g_error_free(error);
+  lua_pushstring(state, value);
+}
 
 static gboolean
 lua_dd_add_parameter_to_table(const gchar *name, TypeHint type, const gchar *value, gsize value_len, gpointer user_data)
 {
-  lua_State *state = (lua_State *) user_data;
+  LuaDestWorker *worker = (LuaDestWorker *) user_data;
+  lua_State *state = worker->state;
 
   lua_pushstring(state, name);
   lua_cast_and_push_value_to_stack(state, name, type, value);
   
-  lua_settable(state, -3);
+  lua_rawset(state, -3);
+  worker->num_params++;
   return FALSE;
 };
 
 static void
-lua_dd_create_parameter_table_for_queue_func(lua_State *state, ValuePairs *params, LogMessage *msg)
+lua_dd_clear_table(lua_State *state, int index)
 {
-  lua_newtable(state);
-  value_pairs_foreach(params, lua_dd_add_parameter_to_table, msg, 0,
-                      LTZ_SEND, NULL, state);
+  if (index < 0)
+    index = lua_gettop(state) + index + 1;
+
+  lua_pushnil(state);
+  while (lua_next(state, index))
+    {
+      lua_pop(state, 1);
+      lua_pushvalue(state, -1);
+      lua_pushnil(state);
+      lua_rawset(state, index);
+    }
+}
+
+/*
+ * The table is sized by the number of pairs of the previous message, so it
+ * is not rehashed while filled. Key strings need no caching, Lua interns
+ * short strings, pushing an existing one does not allocate.
+ */
+static void
+lua_dd_create_parameter_table_for_queue_func(LuaDestWorker *worker, LogMessage *msg, gboolean reuse)
+{
+  lua_State *state = worker->state;
+
+  if (reuse && worker->params_table_ref != LUA_NOREF)
+    {
+      lua_rawgeti(state, LUA_REGISTRYINDEX, worker->params_table_ref);
+      lua_dd_clear_table(state, -1);
+    }
+  else
+    lua_createtable(state, 0, worker->num_params);
+
+  worker->num_params = 0;
+  value_pairs_foreach(worker->owner->params, lua_dd_add_parameter_to_table, msg, 0,
+                      LTZ_SEND, NULL, worker);
+}
+
+static void
+lua_dd_push_message(LuaDestDriver *self, lua_State *state, LogMessage *msg, GString *str)
+{
+  if (self->mode == LUA_DEST_MODE_FORMATTED)
+    {
+      log_template_format(self->template, msg, NULL, 0, 0, NULL, str);
+      lua_pushlstring(state, str->str, str->len);
+    }
+
+  if (self->mode == LUA_DEST_MODE_RAW)
+    {
+      lua_message_create_from_logmsg(state, msg);
+    }
+}
+
+/* pushes the queue function and its arguments, returns the number of arguments */
+static int
+lua_dd_push_queue_func_call(LuaDestWorker *worker, LogMessage *msg, gboolean reuse_params_table)
+{
+  LuaDestDriver *self = worker->owner;
+  lua_State *state = worker->state;
+  GString *str = scratch_buffers_alloc();
+
+  lua_getglobal(state, self->queue_func_name);
+
+  lua_dd_push_message(self, state, msg, str);
+
+  if (self->params)
+    {
+      lua_dd_create_parameter_table_for_queue_func(worker, msg, reuse_params_table);
+      return 2;
+    }
+  return 1;
+}
+
+/*
+ * The queue and batch functions can return one of the syslogng.SUCCESS,
+ * DROP, RETRY and QUEUED constants. true and nil (no return value) mean
+ * success, false means drop; anything else is taken as success, as return
+ * values used to be ignored.
+ */
+static LuaDestResult
+lua_dd_convert_result(lua_State *state, int index)
+{
+  if (lua_isboolean(state, index))
+    return lua_toboolean(state, index) ? LUA_DEST_RESULT_SUCCESS : LUA_DEST_RESULT_DROP;
+
+  if (lua_type(state, index) == LUA_TNUMBER)
+    {
+      switch (lua_tointeger(state, index))
+        {
+        case LUA_DEST_RESULT_DROP:
+          return LUA_DEST_RESULT_DROP;
+        case LUA_DEST_RESULT_RETRY:
+          return LUA_DEST_RESULT_RETRY;
+        case LUA_DEST_RESULT_QUEUED:
+          return LUA_DEST_RESULT_QUEUED;
+        default:
+          break;
+        }
+    }
+  return LUA_DEST_RESULT_SUCCESS;
+}
+
+static void
+lua_dd_register_result_constants(lua_State *state)
+{
+  lua_getglobal(state, "syslogng");
+  lua_pushinteger(state, LUA_DEST_RESULT_SUCCESS);
+  lua_setfield(state, -2, "SUCCESS");
+  lua_pushinteger(state, LUA_DEST_RESULT_DROP);
+  lua_setfield(state, -2, "DROP");
+  lua_pushinteger(state, LUA_DEST_RESULT_RETRY);
+  lua_setfield(state, -2, "RETRY");
+  lua_pushinteger(state, LUA_DEST_RESULT_QUEUED);
+  lua_setfield(state, -2, "QUEUED");
+  lua_pop(state, 1);
+}
+
+/*
+ * Call statistics: the time spent in the Lua function and the Lua heap
+ * size right after the call, so slow scripts and leaking or GC-heavy ones
+ * can be told apart. Blocking I/O done by the script is part of the call
+ * time, except in async mode, where only the time until the coroutine
+ * yields is counted. With workers() the maximum is updated without
+ * locking, so it is only approximate.
+ */
+static void
+lua_dd_account_call(LuaDestDriver *self, lua_State *state, gint64 start, gboolean finished, gboolean success)
+{
+  gint64 elapsed = g_get_monotonic_time() - start;
+
+  if (finished)
+    stats_counter_inc(self->call_count);
+  if (!success)
+    stats_counter_inc(self->call_errors);
+
+  stats_counter_add(self->call_time, elapsed);
+  if (self->max_call_time && elapsed > stats_counter_get(self->max_call_time))
+    stats_counter_set(self->max_call_time, elapsed);
+  stats_counter_set(self->heap_size, lua_gc(state, LUA_GCCOUNT, 0));
+}
+
+/*
+ * The allocator refused an allocation as the state reached memory_limit():
+ * collect garbage and ask for a retry, so the queue is kept and the
+ * destination is suspended instead of dropping messages.
+ */
+static LuaDestResult
+lua_dd_memory_exceeded(LuaDestWorker *worker, lua_State *state)
+{
+  LuaDestDriver *self = worker->owner;
+
+  lua_gc(worker->state, LUA_GCCOLLECT, 0);
+  msg_error("Lua destination reached its memory limit, retrying later",
+            evt_tag_str("error", lua_tostring(state, -1)),
+            evt_tag_long("memory_limit", self->memory_limit),
+            evt_tag_long("memory_used", worker->memory_used),
+            evt_tag_str("driver_id", self->super.super.super.id),
+            NULL);
+  lua_pop(state, 1);
+  return LUA_DEST_RESULT_RETRY;
+}
+
+static int
+lua_dd_pcall(LuaDestWorker *worker, lua_State *state, int nargs, int nresults)
+{
+  int status;
+
+  worker->in_protected_call = TRUE;
+  status = lua_pcall(state, nargs, nresults, 0);
+  worker->in_protected_call = FALSE;
+  return status;
+}
+
+static LuaDestResult
+lua_dd_call_queue_func(LuaDestWorker *worker, LogMessage *msg)
+{
+  LuaDestDriver *self = worker->owner;
+  lua_State *state = worker->state;
+  int number_of_parameters = lua_dd_push_queue_func_call(worker, msg, TRUE);
+  gint64 start = g_get_monotonic_time();
+  LuaDestResult result;
+  int status;
+
+  status = lua_dd_pcall(worker, state, number_of_parameters, 1);
+  if (status != 0)
+    {
+      lua_dd_account_call(self, state, start, TRUE, FALSE);
+      if (status == LUA_ERRMEM)
+        return lua_dd_memory_exceeded(worker, state);
+
+      msg_error("Error happened during calling Lua destination function!",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("queue_func", self->queue_func_name),
+                evt_tag_str("filename", self->filename),
+                evt_tag_str("driver_id", self->super.super.super.id),
+                NULL);
+      lua_pop(state, 1);
+      return LUA_DEST_RESULT_DROP;
+    }
+
+  lua_dd_account_call(self, state, start, TRUE, TRUE);
+  result = lua_dd_convert_result(state, -1);
+  lua_pop(state, 1);
+  return result;
+}
+
+static LuaDestResult
+lua_dd_call_batch_func(LuaDestWorker *worker, LogMessage **msgs, guint num_msgs)
+{
+  LuaDestDriver *self = worker->owner;
+  lua_State *state = worker->state;
+  GString *str = scratch_buffers_alloc();
+  int number_of_parameters = 1;
+  LuaDestResult result;
+  gint64 start;
+  int status;
+  guint i;
+
+  lua_getglobal(state, self->batch_func_name);
+
+  lua_createtable(state, num_msgs, 0);
+  for (i = 0; i < num_msgs; i++)
+    {
+      lua_dd_push_message(self, state, msgs[i], str);
+      lua_rawseti(state, -2, i + 1);
+    }
+
+  if (self->params)
+    {
+      lua_createtable(state, num_msgs, 0);
+      for (i = 0; i < num_msgs; i++)
+        {
+          lua_dd_create_parameter_table_for_queue_func(worker, msgs[i], FALSE);
+          lua_rawseti(state, -2, i + 1);
+        }
+      number_of_parameters = 2;
+    }
+
+  start = g_get_monotonic_time();
+  status = lua_dd_pcall(worker, state, number_of_parameters, 1);
+  if (status != 0)
+    {
+      lua_dd_account_call(self, state, start, TRUE, FALSE);
+      if (status == LUA_ERRMEM)
+        return lua_dd_memory_exceeded(worker, state);
+
+      msg_error("Error happened during calling Lua destination batch function!",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("batch_func", self->batch_func_name),
+                evt_tag_int("batch_size", num_msgs),
+                evt_tag_str("filename", self->filename),
+                evt_tag_str("driver_id", self->super.super.super.id),
+                NULL);
+      lua_pop(state, 1);
+      return LUA_DEST_RESULT_DROP;
+    }
+
+  lua_dd_account_call(self, state, start, TRUE, TRUE);
+  result = lua_dd_convert_result(state, -1);
+  lua_pop(state, 1);
+  return result;
+}
+
+static LuaDestResult
+lua_dd_call_flush_func(LuaDestWorker *worker)
+{
+  LuaDestDriver *self = worker->owner;
+  lua_State *state = worker->state;
+  LuaDestResult result;
+  int status;
+
+  lua_getglobal(state, self->flush_func_name);
+  status = lua_dd_pcall(worker, state, 0, 1);
+  if (status != 0)
+    {
+      if (status == LUA_ERRMEM)
+        return lua_dd_memory_exceeded(worker, state);
+
+      msg_error("Error happened during calling Lua destination flush function!",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("flush_func", self->flush_func_name),
+                evt_tag_str("filename", self->filename),
+                evt_tag_str("driver_id", self->super.super.super.id),
+                NULL);
+      lua_pop(state, 1);
+      return LUA_DEST_RESULT_DROP;
+    }
+
+  result = lua_dd_convert_result(state, -1);
+  lua_pop(state, 1);
+  return result;
+}
+
+/* puts the given messages, the newest unacknowledged ones, back to the queue */
+static void
+lua_dd_rewind_messages(LuaDestDriver *self, GPtrArray *msgs)
+{
+  guint i;
+
+  if (msgs->len == 0)
+    return;
+
+  log_queue_rewind_backlog(self->super.queue, msgs->len);
+  for (i = 0; i < msgs->len; i++)
+    log_msg_unref(g_ptr_array_index(msgs, i));
+  g_ptr_array_set_size(msgs, 0);
+}
+
+/*
+ * Messages the queue function reported as QUEUED are kept unacknowledged
+ * until a later call (or the flush function) reports a result, which then
+ * applies to all of them. RETRY puts them back to the queue.
+ */
+static void
+lua_dd_settle_queued(LuaDestDriver *self, LuaDestResult result)
+{
+  guint i;
+
+  self->batch_retries = 0;
+
+  if (result == LUA_DEST_RESULT_RETRY)
+    {
+      lua_dd_rewind_messages(self, self->queued);
+      return;
+    }
+
+  for (i = 0; i < self->queued->len; i++)
+    {
+      LogMessage *msg = g_ptr_array_index(self->queued, i);
+
+      if (result == LUA_DEST_RESULT_DROP)
+        log_threaded_dest_driver_message_drop(&self->super, msg);
+      else
+        log_threaded_dest_driver_message_accept(&self->super, msg);
+    }
+  g_ptr_array_set_size(self->queued, 0);
 }
 
 static worker_insert_result_t
 lua_dd_queue(LogThrDestDriver *d, LogMessage *msg)
 {
   LuaDestDriver *self = (LuaDestDriver *) d;
-  LogPathOptions path_options = LOG_PATH_OPTIONS_INIT;
-  GString *str = scratch_buffers_alloc();
-  gboolean success;
-  int number_of_parameters = 1;
+  LuaDestWorker *worker = g_ptr_array_index(self->workers, 0);
+
+  switch (lua_dd_call_queue_func(worker, msg))
+    {
+    case LUA_DEST_RESULT_QUEUED:
+      g_ptr_array_add(self->queued, msg);
+      return WORKER_INSERT_RESULT_EXPLICIT_ACK_MGMT;
+
+    case LUA_DEST_RESULT_RETRY:
+      if (self->queued->len == 0)
+        return WORKER_INSERT_RESULT_ERROR;
+
+      /* the held messages are older than the current one in the backlog,
+       * so the threaded destination cannot retry them with it */
+      if (++self->batch_retries >= self->super.retries.max)
+        {
+          msg_error("Lua destination function asked for a retry too many times, dropping messages",
+                    evt_tag_int("messages", self->queued->len + 1),
+                    evt_tag_int("retries", self->batch_retries),
+                    evt_tag_str("driver_id", self->super.super.super.id),
+                    NULL);
+          lua_dd_settle_queued(self, LUA_DEST_RESULT_DROP);
+          return WORKER_INSERT_RESULT_DROP;
+        }
+
+      /* rewind the held messages together with the current one (the
+       * rewind of the threaded destination finds an empty backlog then),
+       * and suspend for time_reopen() */
+      log_queue_rewind_backlog(self->super.queue, self->queued->len + 1);
+      g_ptr_array_foreach(self->queued, (GFunc) log_msg_unref, NULL);
+      g_ptr_array_set_size(self->queued, 0);
+      return WORKER_INSERT_RESULT_NOT_CONNECTED;
+
+    case LUA_DEST_RESULT_DROP:
+      lua_dd_settle_queued(self, LUA_DEST_RESULT_DROP);
+      return WORKER_INSERT_RESULT_DROP;
+
+    default:
+      lua_dd_settle_queued(self, LUA_DEST_RESULT_SUCCESS);
+      return WORKER_INSERT_RESULT_SUCCESS;
+    }
+}
+
+/*
+ * Async mode: every queue function call runs in its own coroutine. When the
+ * script waits for a socket (see lua-socket.c), the coroutine yields the
+ * file descriptor and the event, and the call stays in flight while the
+ * next message is started. In-flight calls are driven with poll() from the
+ * destination thread: blocking when max_in_flight is reached, and without
+ * blocking, repeated every LUA_DEST_ASYNC_POLL_INTERVAL msecs, while the
+ * queue is empty. Acknowledgement is by count, always of the oldest
+ * message, so calls are kept in queue order and settled once every
+ * earlier call has finished. RETRY restarts the call after time_reopen(),
+ * up to retries() times, keeping its in-flight slot meanwhile; QUEUED
+ * counts as success.
+ */
+static void
+lua_dd_async_finish(LuaDestDriver *self, LuaDestAsyncCall *call, gboolean success)
+{
+  LuaDestWorker *worker = g_ptr_array_index(self->workers, 0);
+
+  luaL_unref(worker->state, LUA_REGISTRYINDEX, call->thread_ref);
+  call->done = TRUE;
+  call->success = success;
+}
+
+static void
+lua_dd_async_settle(LuaDestDriver *self)
+{
+  guint i;
+
+  for (i = 0; i < self->in_flight->len; i++)
+    {
+      LuaDestAsyncCall *call = g_ptr_array_index(self->in_flight, i);
+
+      if (!call->done)
+        break;
+
+      if (call->success)
+        log_threaded_dest_driver_message_accept(&self->super, call->msg);
+      else
+        log_threaded_dest_driver_message_drop(&self->super, call->msg);
+      g_free(call);
+    }
+  g_ptr_array_remove_range(self->in_flight, 0, i);
+}
+
+/* returns TRUE if the call has finished */
+static gboolean
+lua_dd_async_resume(LuaDestDriver *self, LuaDestAsyncCall *call, int nargs)
+{
+  LuaDestWorker *worker = g_ptr_array_index(self->workers, 0);
+  gint64 start = g_get_monotonic_time();
+  LuaDestResult result;
+  int status;
+
+  worker->in_protected_call = TRUE;
+  status = lua_dd_resume(call->thread, worker->state, nargs);
+  worker->in_protected_call = FALSE;
+
+  lua_dd_account_call(self, worker->state, start, status != LUA_YIELD, status == LUA_YIELD || status == 0);
+  if (status == LUA_YIELD)
+    {
+      const char *events = lua_tostring(call->thread, 2);
+
+      call->fd = lua_isnumber(call->thread, 1) ? lua_tointeger(call->thread, 1) : -1;
+      call->events = (events && events[0] == 'w') ? POLLOUT : POLLIN;
+      call->deadline = g_get_monotonic_time() + (gint64) self->async_timeout * G_USEC_PER_SEC;
+      lua_settop(call->thread, 0);
+      return FALSE;
+    }
+
+  if (status == LUA_ERRMEM)
+    {
+      result = lua_dd_memory_exceeded(worker, call->thread);
+    }
+  else if (status != 0)
+    {
+      msg_error("Error happened during calling Lua destination function!",
+                evt_tag_str("error", lua_tostring(call->thread, -1)),
+                evt_tag_str("queue_func", self->queue_func_name),
+                evt_tag_str("filename", self->filename),
+                evt_tag_str("driver_id", self->super.super.super.id),
+                NULL);
+      lua_dd_async_finish(self, call, FALSE);
+      return TRUE;
+    }
+  else
+    {
+      result = lua_gettop(call->thread) > 0 ? lua_dd_convert_result(call->thread, 1) : LUA_DEST_RESULT_SUCCESS;
+    }
+
+  if (result == LUA_DEST_RESULT_RETRY && call->attempts < self->super.retries.max)
+    {
+      luaL_unref(worker->state, LUA_REGISTRYINDEX, call->thread_ref);
+      call->attempts++;
+      call->fd = -1;
+      call->retry_at = g_get_monotonic_time() + (gint64) self->super.time_reopen * G_USEC_PER_SEC;
+      call->deadline = call->retry_at;
+      return FALSE;
+    }
+
+  lua_dd_async_finish(self, call, result != LUA_DEST_RESULT_DROP && result != LUA_DEST_RESULT_RETRY);
+  return TRUE;
+}
+
+static gboolean
+lua_dd_async_start(LuaDestDriver *self, LuaDestAsyncCall *call)
+{
+  LuaDestWorker *worker = g_ptr_array_index(self->workers, 0);
+  int nargs;
+
+  call->thread = lua_newthread(worker->state);
+  call->thread_ref = luaL_ref(worker->state, LUA_REGISTRYINDEX);
+
+  nargs = lua_dd_push_queue_func_call(worker, call->msg, FALSE);
+  lua_xmove(worker->state, call->thread, nargs + 1);
+
+  return lua_dd_async_resume(self, call, nargs);
+}
+
+static void
+lua_dd_async_poll(LuaDestDriver *self, gboolean block)
+{
+  guint num_calls = self->in_flight->len;
+  struct pollfd *fds = g_new(struct pollfd, num_calls);
+  gint64 now = g_get_monotonic_time();
+  gint64 first_deadline = G_MAXINT64;
+  gint timeout;
+  guint i;
+
+  for (i = 0; i < num_calls; i++)
+    {
+      LuaDestAsyncCall *call = g_ptr_array_index(self->in_flight, i);
+
+      /* poll() ignores negative descriptors */
+      fds[i].fd = call->done ? -1 : call->fd;
+      fds[i].events = call->events;
+      fds[i].revents = 0;
+      if (call->done)
+        continue;
+      if (call->fd < 0 && !call->retry_at)
+        first_deadline = now;
+      first_deadline = MIN(first_deadline, call->deadline);
+    }
+
+  /* first_deadline stays G_MAXINT64 if every call is finished */
+  if (!block || first_deadline <= now || first_deadline == G_MAXINT64)
+    timeout = 0;
+  else
+    timeout = (gint) MIN((first_deadline - now) / 1000 + 1, G_MAXINT);
+  if (poll(fds, num_calls, timeout) < 0 && errno != EINTR)
+    msg_error("Error polling the sockets of the Lua destination",
+              evt_tag_errno("error", errno),
+              evt_tag_str("driver_id", self->super.super.super.id),
+              NULL);
+
+  now = g_get_monotonic_time();
+  for (i = 0; i < num_calls; i++)
+    {
+      LuaDestAsyncCall *call = g_ptr_array_index(self->in_flight, i);
+
+      if (call->done)
+        continue;
+
+      if (call->retry_at)
+        {
+          if (now >= call->retry_at)
+            {
+              call->retry_at = 0;
+              lua_dd_async_start(self, call);
+            }
+        }
+      else if (call->fd < 0 || fds[i].revents)
+        lua_dd_async_resume(self, call, 0);
+      else if (now >= call->deadline)
+        {
+          msg_error("Lua destination function timed out waiting for I/O",
+                    evt_tag_str("queue_func", self->queue_func_name),
+                    evt_tag_int("timeout", self->async_timeout),
+                    evt_tag_str("driver_id", self->super.super.super.id),
+                    NULL);
+          lua_dd_async_finish(self, call, FALSE);
+        }
+    }
+  g_free(fds);
+
+  lua_dd_async_settle(self);
+}
+
+static worker_insert_result_t
+lua_dd_queue_async(LogThrDestDriver *d, LogMessage *msg)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+  LuaDestAsyncCall *call = g_new0(LuaDestAsyncCall, 1);
+
+  call->msg = msg;
+  g_ptr_array_add(self->in_flight, call);
+  lua_dd_async_start(self, call);
+  lua_dd_async_settle(self);
+
+  while (self->in_flight->len >= (guint) self->max_in_flight)
+    lua_dd_async_poll(self, TRUE);
+
+  return WORKER_INSERT_RESULT_EXPLICIT_ACK_MGMT;
+}
+
+static void
+lua_dd_async_timer_expired(void *cookie)
+{
+  LuaDestDriver *self = (LuaDestDriver *) cookie;
+
+  lua_dd_async_poll(self, FALSE);
+  if (self->in_flight->len == 0)
+    return;
+
+  iv_validate_now();
+  self->async_timer.expires = iv_now;
+  timespec_add_msec(&self->async_timer.expires, LUA_DEST_ASYNC_POLL_INTERVAL);
+  iv_timer_register(&self->async_timer);
+}
+
+/* drives the in-flight calls while the queue is empty, without blocking */
+static void
+lua_dd_async_schedule_poll(LuaDestDriver *self)
+{
+  if (self->in_flight->len == 0 || iv_timer_registered(&self->async_timer))
+    return;
+
+  lua_dd_async_timer_expired(self);
+}
+
+/* on shutdown, calls waiting for a retry are restarted without the delay */
+static void
+lua_dd_async_drain(LuaDestDriver *self)
+{
+  guint i;
+
+  if (iv_timer_registered(&self->async_timer))
+    iv_timer_unregister(&self->async_timer);
+
+  while (self->in_flight->len > 0)
+    {
+      for (i = 0; i < self->in_flight->len; i++)
+        {
+          LuaDestAsyncCall *call = g_ptr_array_index(self->in_flight, i);
+
+          if (call->retry_at)
+            call->retry_at = call->deadline = 1;
+        }
+      lua_dd_async_poll(self, TRUE);
+    }
+}
+
+/*
+ * Workers: every worker has its own lua_State, as a state cannot be used
+ * from more than one thread. The pending messages of a round are split
+ * into contiguous slices; the first slice is processed by the destination
+ * thread itself, the others by the worker threads. Acknowledgement happens
+ * in the destination thread once all slices are done, in queue order.
+ */
+static gchar lua_dd_worker_exit_marker;
+
+static void
+lua_dd_worker_process(LuaDestWorker *worker)
+{
+  LuaDestDriver *self = worker->owner;
+  guint i;
+
+  if (self->batch_func_name)
+    {
+      LuaDestResult result = lua_dd_call_batch_func(worker, worker->msgs, worker->num_msgs);
+
+      for (i = 0; i < worker->num_msgs; i++)
+        worker->results[i] = result;
+      return;
+    }
+
+  for (i = 0; i < worker->num_msgs; i++)
+    worker->results[i] = lua_dd_call_queue_func(worker, worker->msgs[i]);
+}
+
+static gpointer
+lua_dd_worker_thread(gpointer user_data)
+{
+  LuaDestWorker *worker = (LuaDestWorker *) user_data;
+
+  scratch_buffers_allocator_init();
+  while (g_async_queue_pop(worker->jobs) != &lua_dd_worker_exit_marker)
+    {
+      lua_dd_worker_process(worker);
+      scratch_buffers_explicit_gc();
+      g_async_queue_push(worker->owner->replies, worker);
+    }
+  scratch_buffers_allocator_deinit();
+  return NULL;
+}
+
+static LuaDestWorker *
+lua_dd_worker_new(LuaDestDriver *owner)
+{
+  LuaDestWorker *self = g_new0(LuaDestWorker, 1);
+
+  self->owner = owner;
+  self->jobs = g_async_queue_new();
+  self->params_table_ref = LUA_NOREF;
+  return self;
+}
+
+static void
+lua_dd_worker_free(LuaDestWorker *self)
+{
+  if (self->state)
+    lua_close(self->state);
+  g_async_queue_unref(self->jobs);
+  g_free(self);
+}
+
+static void
+lua_dd_arm_batch_timer(LuaDestDriver *self, glong msec)
+{
+  if (iv_timer_registered(&self->batch_timer))
+    return;
+
+  iv_validate_now();
+  self->batch_timer.expires = iv_now;
+  timespec_add_msec(&self->batch_timer.expires, msec);
+  iv_timer_register(&self->batch_timer);
+}
+
+/*
+ * Called when the queue runs empty while messages are held back as QUEUED.
+ * The flush function can return QUEUED again (it is called again after
+ * time_reopen()) or RETRY, in which case the messages are kept and the
+ * flush is retried after time_reopen(), at most retries() times.
+ */
+static void
+lua_dd_flush_queued(LuaDestDriver *self)
+{
+  LuaDestResult result;
+
+  if (self->queued->len == 0 || !self->flush_func_name)
+    return;
+
+  result = lua_dd_call_flush_func(g_ptr_array_index(self->workers, 0));
+  switch (result)
+    {
+    case LUA_DEST_RESULT_QUEUED:
+      lua_dd_arm_batch_timer(self, self->super.time_reopen * 1000);
+      return;
+
+    case LUA_DEST_RESULT_RETRY:
+      if (++self->batch_retries < self->super.retries.max)
+        {
+          msg_error("Lua destination flush function asked for a retry, flushing again later",
+                    evt_tag_int("messages", self->queued->len),
+                    evt_tag_int("retries", self->batch_retries),
+                    evt_tag_int("time_reopen", self->super.time_reopen),
+                    evt_tag_str("driver_id", self->super.super.super.id),
+                    NULL);
+          lua_dd_arm_batch_timer(self, self->super.time_reopen * 1000);
+          return;
+        }
+      result = LUA_DEST_RESULT_DROP;
+      break;
+
+    default:
+      break;
+    }
+
+  lua_dd_settle_queued(self, result);
+}
+
+/*
+ * Batch mode: messages are kept (unacknowledged) until batch_size of them
+ * per worker are collected, or batch_timeout msecs passed since the queue
+ * ran empty, then the batch function is called once with an array of
+ * them. Acknowledgement is done here, as the threaded destination only
+ * sees WORKER_INSERT_RESULT_EXPLICIT_ACK_MGMT.
+ *
+ * Acknowledgement is by count, always of the oldest message, so only a
+ * leading run of results is settled: from the first message the batch or
+ * queue function asked to retry on, every message stays in the pending
+ * batch and is resubmitted after time_reopen() by the batch timer, at most
+ * retries() times. While a retry is pending, no new messages are taken
+ * from the queue. QUEUED is only meaningful for the queue function without
+ * batching, here it drops the message.
+ */
+static void
+lua_dd_flush_batch(LuaDestDriver *self)
+{
+  LogMessage **msgs = (LogMessage **) self->batch->pdata;
+  guint num_msgs = self->batch->len;
+  guint num_workers, start = 0, kept, i;
+  LuaDestResult *results;
+  gboolean retry, rejected_queued = FALSE;
+
+  if (iv_timer_registered(&self->batch_timer))
+    iv_timer_unregister(&self->batch_timer);
+
+  if (num_msgs == 0)
+    return;
+
+  num_workers = MIN(self->workers->len, num_msgs);
+  results = g_new(LuaDestResult, num_msgs);
+
+  for (i = 0; i < num_workers; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(self->workers, i);
+      guint end = (num_msgs * (i + 1)) / num_workers;
+
+      worker->msgs = msgs + start;
+      worker->num_msgs = end - start;
+      worker->results = results + start;
+      start = end;
+
+      if (i > 0)
+        g_async_queue_push(worker->jobs, worker);
+    }
+
+  lua_dd_worker_process(g_ptr_array_index(self->workers, 0));
+
+  for (i = 1; i < num_workers; i++)
+    g_async_queue_pop(self->replies);
+
+  retry = self->batch_retries < self->super.retries.max;
+  for (i = 0; i < num_msgs; i++)
+    {
+      if (results[i] == LUA_DEST_RESULT_RETRY && retry)
+        break;
+
+      switch (results[i])
+        {
+        case LUA_DEST_RESULT_SUCCESS:
+          log_threaded_dest_driver_message_accept(&self->super, msgs[i]);
+          break;
+        case LUA_DEST_RESULT_QUEUED:
+          rejected_queued = TRUE;
+          /* fall through */
+        default:
+          log_threaded_dest_driver_message_drop(&self->super, msgs[i]);
+          break;
+        }
+    }
+  kept = num_msgs - i;
+  memmove(msgs, msgs + i, kept * sizeof(LogMessage *));
+  g_ptr_array_set_size(self->batch, kept);
+  g_free(results);
+
+  if (rejected_queued)
+    msg_error("Lua destination function returned QUEUED, which is not supported with batch_func() or workers(), dropping messages",
+              evt_tag_str("driver_id", self->super.super.super.id),
+              NULL);
+
+  if (kept > 0)
+    {
+      msg_error("Lua destination function asked for a retry, resubmitting messages later",
+                evt_tag_int("messages", kept),
+                evt_tag_int("retries", self->batch_retries + 1),
+                evt_tag_int("time_reopen", self->super.time_reopen),
+                evt_tag_str("driver_id", self->super.super.super.id),
+                NULL);
+      self->batch_retries++;
+      self->batch_retry_pending = TRUE;
+      lua_dd_arm_batch_timer(self, self->super.time_reopen * 1000);
+    }
+  else
+    {
+      self->batch_retries = 0;
+      self->batch_retry_pending = FALSE;
+      self->super.retries.counter = 0;
+    }
+}
+
+static void
+lua_dd_batch_timer_expired(void *cookie)
+{
+  LuaDestDriver *self = (LuaDestDriver *) cookie;
+
+  if (self->batch_func_name || self->workers->len > 1)
+    lua_dd_flush_batch(self);
+  else
+    lua_dd_flush_queued(self);
+}
+
+static worker_insert_result_t
+lua_dd_queue_batch(LogThrDestDriver *d, LogMessage *msg)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  /* the pending batch is resubmitted by the batch timer, this message was
+   * not tried yet, so it is put back without counting a retry */
+  if (self->batch_retry_pending)
+    return WORKER_INSERT_RESULT_NOT_CONNECTED;
+
+  g_ptr_array_add(self->batch, msg);
+
+  if (self->batch->len >= (guint) self->batch_size * self->workers->len)
+    lua_dd_flush_batch(self);
+
+  return WORKER_INSERT_RESULT_EXPLICIT_ACK_MGMT;
+}
+
+static void
+lua_dd_worker_message_queue_empty(LogThrDestDriver *d)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  lua_dd_async_schedule_poll(self);
+
+  if (self->queued->len > 0 && !iv_timer_registered(&self->batch_timer))
+    lua_dd_flush_queued(self);
 
-  lua_getglobal(self->state, self->queue_func_name);
+  if (self->batch->len == 0 || self->batch_retry_pending)
+    return;
 
-  if (self->mode == LUA_DEST_MODE_FORMATTED)
+  if (self->batch_timeout <= 0)
     {
-      log_template_format(self->template, msg, NULL, 0, 0, NULL, str);
-      lua_pushlstring(self->state, str->str, str->len);
+      lua_dd_flush_batch(self);
+      return;
     }
 
-  if (self->mode == LUA_DEST_MODE_RAW)
-    {
-      lua_message_create_from_logmsg(self->state, msg);
-    }
+  lua_dd_arm_batch_timer(self, self->batch_timeout);
+}
 
-  if (self->params)
+static void
+lua_dd_worker_thread_init(LogThrDestDriver *d)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+  guint i;
+
+  for (i = 1; i < self->workers->len; i++)
     {
-      lua_dd_create_parameter_table_for_queue_func(self->state, self->params, msg);
-      number_of_parameters = 2;
+      LuaDestWorker *worker = g_ptr_array_index(self->workers, i);
+
+      worker->thread = g_thread_new("lua-dest-worker", lua_dd_worker_thread, worker);
     }
+}
+
+static void
+lua_dd_worker_thread_deinit(LogThrDestDriver *d)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+  guint i;
 
-  success = !lua_pcall(self->state, number_of_parameters, 0, 0);
+  lua_dd_async_drain(self);
+  if (!self->batch_retry_pending)
+    lua_dd_flush_batch(self);
+  lua_dd_flush_queued(self);
 
-  if (success)
-   {
-     return WORKER_INSERT_RESULT_SUCCESS;
-   }
-  else
-   {
-     msg_error("Error happened during calling Lua destination function!",
-              evt_tag_str("error", lua_tostring(self->state, -1)),
-              evt_tag_str("queue_func", self->queue_func_name),
-              evt_tag_str("filename", self->filename),
-              evt_tag_str("driver_id", self->super.super.super.id),
-              NULL);
+  if (iv_timer_registered(&self->batch_timer))
+    iv_timer_unregister(&self->batch_timer);
+  lua_dd_rewind_messages(self, self->batch);
+  lua_dd_rewind_messages(self, self->queued);
+  self->batch_retry_pending = FALSE;
 
-     lua_dd_drop_message(self, msg, &path_options);
-     return WORKER_INSERT_RESULT_DROP;
-   }  
+  for (i = 1; i < self->workers->len; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(self->workers, i);
 
-};
+      g_async_queue_push(worker->jobs, &lua_dd_worker_exit_marker);
+      g_thread_join(worker->thread);
+      worker->thread = NULL;
+    }
+}
 
+static gchar *lua_dd_format_stats_instance(LogThrDestDriver *d);
+static const gchar *lua_dd_format_persist_name(const LogPipe *d);
 
 static gboolean
-lua_dd_check_and_call_function(LuaDestDriver *self, const char *function_name, const char *function_type)
+lua_dd_check_and_call_function(LuaDestDriver *self, lua_State *state, const char *function_name, const char *function_type)
 {
   msg_debug("Calling lua destination function", evt_tag_str("function_type", function_type), NULL);
 
-  lua_getglobal(self->state, function_name);
+  lua_getglobal(state, function_name);
 
-  if (lua_isnil(self->state, -1))
+  if (lua_isnil(state, -1))
     {
       msg_warning("Lua destination function cannot be found, continueing anyway!",
                   evt_tag_str("function_type", function_type),
@@ -202,39 +1239,55 @@ lua_dd_check_and_call_function(LuaDestDriver *self, const char *function_name, c
                   evt_tag_str("filename", self->filename),
                   evt_tag_str("driver_id", self->super.super.super.id),
                   NULL);
+      lua_pop(state, 1);
       return TRUE;
     }
 
-  if (lua_pcall(self->state, 0, 0, 0))
+  if (lua_pcall(state, 0, 0, 0))
     {
       msg_error("Error happened during calling Lua destination initializing function!",
-                evt_tag_str("error", lua_tostring(self->state, -1)),
+                evt_tag_str("error", lua_tostring(state, -1)),
                 evt_tag_str("function_type", function_type),
                 evt_tag_str("function_name", function_name),
                 evt_tag_str("filename", self->filename),
                 evt_tag_str("driver_id", self->super.super.super.id),
                 NULL);
+      lua_pop(state, 1);
       return FALSE;
     }
   return TRUE;
 };
 
 static gboolean
-lua_dd_call_init_func(LuaDestDriver *self)
+lua_dd_call_init_func(LuaDestDriver *self, lua_State *state)
 {
-  return lua_dd_check_and_call_function(self, self->init_func_name, "initialization");
+  return lua_dd_check_and_call_function(self, state, self->init_func_name, "initialization");
 }
 
 static gboolean
-lua_dd_call_deinit_func(LuaDestDriver *self)
+lua_dd_call_deinit_func(LuaDestDriver *self, lua_State *state)
 {
-  return lua_dd_check_and_call_function(self, self->deinit_func_name, "deinitialization");
+  return lua_dd_check_and_call_function(self, state, self->deinit_func_name, "deinitialization");
 }
 
 static gboolean
-lua_dd_check_existence_of_queue_func(LuaDestDriver *self)
+lua_dd_check_existence_of_queue_func(LuaDestDriver *self, lua_State *state)
 {
-  if (!lua_check_existence_of_global_variable(self->state, self->queue_func_name))
+  if (self->batch_func_name)
+    {
+      if (!lua_check_existence_of_global_variable(state, self->batch_func_name))
+        {
+          msg_error("Lua destination batch function cannot be found!",
+                    evt_tag_str("batch_func", self->batch_func_name),
+                    evt_tag_str("filename", self->filename),
+                    evt_tag_str("driver_id", self->super.super.super.id),
+                    NULL);
+          return FALSE;
+        }
+      return TRUE;
+    }
+
+  if (!lua_check_existence_of_global_variable(state, self->queue_func_name))
     {
       msg_error("Lua destination queue function cannot be found!",
                 evt_tag_str("queue_func", self->queue_func_name),
@@ -272,33 +1325,344 @@ lua_dd_inject_all_global_variables(lua_State *state, GList *globals)
   g_list_foreach(globals, lua_dd_inject_global_variable, state);
 };
 
+/*
+ * Allocator used when memory_limit() is set. The limit is only enforced
+ * while the script runs in a protected call (see lua_dd_pcall()), as an
+ * allocation failure elsewhere, e.g. while the arguments of the call are
+ * pushed, would run the panic handler and abort.
+ */
+static void *
+lua_dd_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  LuaDestWorker *worker = (LuaDestWorker *) ud;
+  /* if ptr is NULL, osize is not a size in Lua 5.2 */
+  gsize old_size = ptr ? osize : 0;
+  void *new_ptr;
+
+  if (nsize == 0)
+    {
+      free(ptr);
+      worker->memory_used -= old_size;
+      return NULL;
+    }
+
+  if (worker->in_protected_call && worker->memory_limit && nsize > old_size &&
+      worker->memory_used - old_size + nsize > worker->memory_limit)
+    return NULL;
+
+  new_ptr = realloc(ptr, nsize);
+  if (new_ptr)
+    worker->memory_used = worker->memory_used - old_size + nsize;
+  return new_ptr;
+}
+
+static lua_State *
+lua_dd_new_state(LuaDestDriver *self, LuaDestWorker *worker)
+{
+  lua_State *state;
+
+  if (!self->memory_limit)
+    return luaL_newstate();
+
+  state = lua_newstate(lua_dd_alloc, worker);
+  if (!state)
+    {
+      /* 64 bit LuaJIT does not support custom allocators */
+      msg_warning("Lua runtime does not support custom allocators, memory_limit() is ignored",
+                  evt_tag_str("driver_id", self->super.super.super.id),
+                  NULL);
+      state = luaL_newstate();
+    }
+  return state;
+}
+
+static void
+lua_dd_configure_gc(LuaDestDriver *self, lua_State *state)
+{
+  if (self->gc_mode == LUA_DEST_GC_GENERATIONAL)
+    {
+#ifdef LUA_GCGEN
+      lua_gc(state, LUA_GCGEN, 0);
+#else
+      msg_warning("Generational garbage collection is not supported by the Lua runtime, using incremental mode",
+                  evt_tag_str("driver_id", self->super.super.super.id),
+                  NULL);
+#endif
+    }
+#ifdef LUA_GCINC
+  else if (self->gc_mode == LUA_DEST_GC_INCREMENTAL)
+    lua_gc(state, LUA_GCINC, 0);
+#endif
+
+  if (self->gc_pause > 0)
+    lua_gc(state, LUA_GCSETPAUSE, self->gc_pause);
+  if (self->gc_step_multiplier > 0)
+    lua_gc(state, LUA_GCSETSTEPMUL, self->gc_step_multiplier);
+}
+
+static lua_State *
+lua_dd_create_state(LuaDestDriver *self, LuaDestWorker *worker, GlobalConfig *cfg)
+{
+  lua_State *state = lua_dd_new_state(self, worker);
+
+  luaL_openlibs(state);
+  lua_register_cached_searcher(state);
+  lua_dd_configure_gc(self, state);
+
+  if (!lua_dd_load_file(self, state))
+    {
+      lua_close(state);
+      return NULL;
+    }
+
+  lua_register_message(state);
+  lua_register_template_class(state);
+
+  lua_register_utility_functions(state);
+  lua_register_value_pairs(state);
+  lua_dd_register_result_constants(state);
+  lua_register_socket(state);
+
+  lua_dd_set_config_variable(state, cfg);
+  lua_dd_inject_all_global_variables(state, self->globals);
+
+  return state;
+}
+
+static void
+lua_dd_free_workers(LuaDestDriver *self)
+{
+  g_ptr_array_foreach(self->workers, (GFunc) lua_dd_worker_free, NULL);
+  g_ptr_array_set_size(self->workers, 0);
+}
+
+/*
+ * persist_state(yes): on deinit the workers and their Lua states are put
+ * into the persist config instead of being closed, and the next
+ * configuration takes them over if the script file and the settings the
+ * states were built with are unchanged. The init and deinit functions are
+ * not called in that case; the deinit function runs when the states are
+ * finally dropped.
+ *
+ * Templates and value-pairs objects are compiled against the
+ * configuration, which is freed on reload, so states that still hold any
+ * of them after dropping the cached ones are closed as usual instead.
+ */
+typedef struct _LuaDestPersistedStates
+{
+  GPtrArray *workers;
+  gchar *signature;
+  gchar *deinit_func_name;
+} LuaDestPersistedStates;
+
+static gchar *
+lua_dd_format_state_persist_name(LuaDestDriver *self)
+{
+  return g_strdup_printf("lua_dd_states(%s)", lua_dd_format_persist_name(&self->super.super.super.super));
+}
+
+static gchar *
+lua_dd_format_state_signature(LuaDestDriver *self)
+{
+  struct stat st;
+
+  if (stat(self->filename, &st) < 0)
+    st.st_mtime = 0;
+
+  return g_strdup_printf("%s,%ld,%s,%s,%s,%s,%d,%d,%d,%" G_GSIZE_FORMAT,
+                         self->filename, (long) st.st_mtime,
+                         self->init_func_name, self->queue_func_name, self->deinit_func_name,
+                         self->batch_func_name ? self->batch_func_name : "",
+                         self->num_workers, self->async, self->reuse_params_table,
+                         self->memory_limit);
+}
+
+static void
+lua_dd_persisted_states_free(LuaDestPersistedStates *persisted)
+{
+  guint i;
+
+  for (i = 0; i < persisted->workers->len; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(persisted->workers, i);
+
+      lua_getglobal(worker->state, persisted->deinit_func_name);
+      if (!lua_isnil(worker->state, -1) && lua_pcall(worker->state, 0, 0, 0))
+        msg_error("Error happened during calling Lua destination deinitializing function!",
+                  evt_tag_str("error", lua_tostring(worker->state, -1)),
+                  evt_tag_str("function_name", persisted->deinit_func_name),
+                  NULL);
+      lua_settop(worker->state, 0);
+      lua_dd_worker_free(worker);
+    }
+
+  g_ptr_array_free(persisted->workers, TRUE);
+  g_free(persisted->signature);
+  g_free(persisted->deinit_func_name);
+  g_free(persisted);
+}
+
 static gboolean
-lua_dd_init(LogPipe *s)
+lua_dd_workers_can_persist(LuaDestDriver *self)
 {
-  LuaDestDriver *self = (LuaDestDriver *) s;
-  GlobalConfig *cfg;
+  guint i;
+
+  for (i = 0; i < self->workers->len; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(self->workers, i);
+
+      lua_template_reset_cache(worker->state);
+      lua_value_pairs_reset_default(worker->state);
+      lua_gc(worker->state, LUA_GCCOLLECT, 0);
+
+      if (lua_count_config_objects(worker->state) > 0)
+        {
+          msg_info("Lua destination script keeps templates or value-pairs, not reusing the Lua states",
+                   evt_tag_int("objects", lua_count_config_objects(worker->state)),
+                   evt_tag_str("driver_id", self->super.super.super.id),
+                   NULL);
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+static void
+lua_dd_persist_workers(LuaDestDriver *self)
+{
+  GlobalConfig *cfg = log_pipe_get_config(&self->super.super.super.super);
+  LuaDestPersistedStates *persisted = g_new0(LuaDestPersistedStates, 1);
+  gchar *persist_name = lua_dd_format_state_persist_name(self);
+  guint i;
+
+  persisted->workers = g_ptr_array_new();
+  for (i = 0; i < self->workers->len; i++)
+    g_ptr_array_add(persisted->workers, g_ptr_array_index(self->workers, i));
+  g_ptr_array_set_size(self->workers, 0);
+
+  persisted->signature = lua_dd_format_state_signature(self);
+  persisted->deinit_func_name = g_strdup(self->deinit_func_name);
+
+  cfg_persist_config_add(cfg, persist_name, persisted, (GDestroyNotify) lua_dd_persisted_states_free, FALSE);
+  g_free(persist_name);
+}
+
+static gboolean
+lua_dd_restore_workers(LuaDestDriver *self, GlobalConfig *cfg)
+{
+  gchar *persist_name = lua_dd_format_state_persist_name(self);
+  LuaDestPersistedStates *persisted = cfg_persist_config_fetch(cfg, persist_name);
+  gchar *signature;
+  guint i;
 
-  if (!lua_dd_load_file(self))
+  g_free(persist_name);
+  if (!persisted)
+    return FALSE;
+
+  signature = lua_dd_format_state_signature(self);
+  if (strcmp(signature, persisted->signature) != 0)
     {
-      lua_close(self->state);
+      msg_info("Lua destination script or settings changed, not reusing the Lua states",
+               evt_tag_str("driver_id", self->super.super.super.id),
+               NULL);
+      g_free(signature);
+      lua_dd_persisted_states_free(persisted);
       return FALSE;
     }
+  g_free(signature);
 
-  lua_register_message(self->state);
-  lua_register_template_class(self->state);
+  for (i = 0; i < persisted->workers->len; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(persisted->workers, i);
 
-  lua_register_utility_functions(self->state);
+      worker->owner = self;
+      lua_dd_set_config_variable(worker->state, cfg);
+      lua_dd_inject_all_global_variables(worker->state, self->globals);
+      g_ptr_array_add(self->workers, worker);
+    }
 
-  cfg = log_pipe_get_config(s);
+  g_ptr_array_set_size(persisted->workers, 0);
+  lua_dd_persisted_states_free(persisted);
 
-  lua_dd_set_config_variable(self->state, cfg);
-  if (self->globals)
+  msg_debug("Lua destination reusing the Lua states of the previous configuration",
+            evt_tag_str("driver_id", self->super.super.super.id),
+            NULL);
+  return TRUE;
+}
+
+static gboolean
+lua_dd_init_workers(LuaDestDriver *self, GlobalConfig *cfg)
+{
+  gint i;
+
+  if (self->persist_state && lua_dd_restore_workers(self, cfg))
+    return TRUE;
+
+  for (i = 0; i < self->num_workers; i++)
     {
-      lua_dd_inject_all_global_variables(self->state, self->globals);
-      g_list_free_full(self->globals, lua_global_constant_free);
-      self->globals = NULL;
+      LuaDestWorker *worker = lua_dd_worker_new(self);
+
+      g_ptr_array_add(self->workers, worker);
+
+      worker->state = lua_dd_create_state(self, worker, cfg);
+      if (!worker->state ||
+          !lua_dd_call_init_func(self, worker->state) ||
+          !lua_dd_check_existence_of_queue_func(self, worker->state))
+        {
+          lua_dd_free_workers(self);
+          return FALSE;
+        }
+
+      if (self->reuse_params_table && !self->batch_func_name)
+        {
+          lua_newtable(worker->state);
+          worker->params_table_ref = luaL_ref(worker->state, LUA_REGISTRYINDEX);
+        }
+
+      worker->memory_limit = self->memory_limit;
     }
 
+  return TRUE;
+}
+
+static void
+lua_dd_register_stats_counter(LuaDestDriver *self, const gchar *name, StatsCounterItem **counter, gboolean do_register)
+{
+  StatsClusterKey sc_key;
+  gchar instance[1024];
+
+  g_snprintf(instance, sizeof(instance), "%s,%s", lua_dd_format_stats_instance(&self->super), name);
+  stats_cluster_logpipe_key_set(&sc_key, SCS_LUA | SCS_DESTINATION, self->super.super.super.id, instance);
+
+  if (do_register)
+    stats_register_counter(1, &sc_key, SC_TYPE_PROCESSED, counter);
+  else
+    stats_unregister_counter(&sc_key, SC_TYPE_PROCESSED, counter);
+}
+
+/*
+ * Registered on stats level 1, as separate lua_dst clusters named after
+ * the instance of the driver and the value they hold. Times are in
+ * microseconds, the heap size is in kilobytes.
+ */
+static void
+lua_dd_register_stats(LuaDestDriver *self, gboolean do_register)
+{
+  stats_lock();
+  lua_dd_register_stats_counter(self, "calls", &self->call_count, do_register);
+  lua_dd_register_stats_counter(self, "call_errors", &self->call_errors, do_register);
+  lua_dd_register_stats_counter(self, "call_time", &self->call_time, do_register);
+  lua_dd_register_stats_counter(self, "max_call_time", &self->max_call_time, do_register);
+  lua_dd_register_stats_counter(self, "heap_size", &self->heap_size, do_register);
+  stats_unlock();
+}
+
+static gboolean
+lua_dd_init(LogPipe *s)
+{
+  LuaDestDriver *self = (LuaDestDriver *) s;
+  GlobalConfig *cfg = log_pipe_get_config(s);
+
   if (!self->template)
     {
       msg_info("No template set in lua destination, falling back to template \"$MESSAGE\"",
@@ -335,30 +1699,68 @@ lua_dd_init(LogPipe *s)
   if (!self->mode)
     self->mode = LUA_DEST_MODE_FORMATTED;
 
-  if (!lua_dd_call_init_func(self))
+  if (self->num_workers <= 0)
+    self->num_workers = 1;
+
+  if (self->async)
     {
-      return FALSE;
+      if (self->batch_func_name || self->num_workers > 1)
+        {
+          msg_error("Lua destination async mode cannot be used together with batch_func() or workers()",
+                    evt_tag_str("driver_id", self->super.super.super.id),
+                    NULL);
+          return FALSE;
+        }
+      if (self->max_in_flight <= 0)
+        self->max_in_flight = LUA_DEST_DEFAULT_MAX_IN_FLIGHT;
+      if (self->async_timeout <= 0)
+        self->async_timeout = LUA_DEST_DEFAULT_ASYNC_TIMEOUT;
+      self->super.worker.insert = lua_dd_queue_async;
+    }
+  else if (self->batch_func_name || self->num_workers > 1)
+    {
+      if (self->batch_size <= 0)
+        self->batch_size = LUA_DEST_DEFAULT_BATCH_SIZE;
+      self->super.worker.insert = lua_dd_queue_batch;
     }
+  else
+    self->super.worker.insert = lua_dd_queue;
 
-  if (!lua_dd_check_existence_of_queue_func(self))
+  if (!lua_dd_init_workers(self, cfg))
     {
       return FALSE;
     }
 
-  return log_threaded_dest_driver_start(s);
+  if (!log_threaded_dest_driver_start(s))
+    return FALSE;
+
+  lua_dd_register_stats(self, TRUE);
+  return TRUE;
 }
 
 static gboolean
 lua_dd_deinit(LogPipe *s)
 {
   LuaDestDriver *self = (LuaDestDriver *) s;
+  gboolean persist = self->persist_state && lua_dd_workers_can_persist(self);
+  guint i;
+
+  for (i = 0; i < self->workers->len && !persist; i++)
+    {
+      LuaDestWorker *worker = g_ptr_array_index(self->workers, i);
+
+      lua_dd_call_deinit_func(self, worker->state);
+    }
 
-  lua_dd_call_deinit_func(self);
+  lua_dd_register_stats(self, FALSE);
 
   if (!log_dest_driver_deinit_method(s))
     return FALSE;
 
-  lua_close(self->state);
+  if (persist)
+    lua_dd_persist_workers(self);
+  else
+    lua_dd_free_workers(self);
 
   return TRUE;
 }
@@ -373,6 +1775,14 @@ lua_dd_free(LogPipe *s)
   g_free(self->filename);
   g_free(self->init_func_name);
   g_free(self->queue_func_name);
+  g_free(self->batch_func_name);
+  g_free(self->flush_func_name);
+  g_ptr_array_free(self->batch, TRUE);
+  g_ptr_array_free(self->queued, TRUE);
+  g_ptr_array_free(self->workers, TRUE);
+  g_ptr_array_free(self->in_flight, TRUE);
+  g_async_queue_unref(self->replies);
+  g_list_free_full(self->globals, lua_global_constant_free);
 }
 
 void
@@ -417,6 +1827,80 @@ lua_dd_set_queue_func(LogDriver *d, gchar *queue_func_name)
   self->queue_func_name = g_strdup(queue_func_name);
 }
 
+void
+lua_dd_set_batch_func(LogDriver *d, gchar *batch_func_name)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  g_free(self->batch_func_name);
+  self->batch_func_name = g_strdup(batch_func_name);
+}
+
+void
+lua_dd_set_flush_func(LogDriver *d, gchar *flush_func_name)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  g_free(self->flush_func_name);
+  self->flush_func_name = g_strdup(flush_func_name);
+}
+
+void
+lua_dd_set_batch_size(LogDriver *d, gint batch_size)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->batch_size = batch_size;
+}
+
+void
+lua_dd_set_batch_timeout(LogDriver *d, gint batch_timeout)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->batch_timeout = batch_timeout;
+}
+
+void
+lua_dd_set_reuse_params_table(LogDriver *d, gboolean reuse)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->reuse_params_table = reuse;
+}
+
+void
+lua_dd_set_async(LogDriver *d, gboolean async)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->async = async;
+}
+
+void
+lua_dd_set_max_in_flight(LogDriver *d, gint max_in_flight)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->max_in_flight = max_in_flight;
+}
+
+void
+lua_dd_set_async_timeout(LogDriver *d, gint async_timeout)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->async_timeout = async_timeout;
+}
+
+void
+lua_dd_set_workers(LogDriver *d, gint num_workers)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->num_workers = num_workers;
+}
+
 void
 lua_dd_set_deinit_func(LogDriver *d, gchar *deinit_func_name)
 {
@@ -438,6 +1922,52 @@ lua_dd_set_mode(LogDriver *d, gchar *mode)
     self->mode = LUA_DEST_MODE_FORMATTED;
 };
 
+gboolean
+lua_dd_set_gc_mode(LogDriver *d, const gchar *gc_mode)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  if (!strcmp("incremental", gc_mode))
+    self->gc_mode = LUA_DEST_GC_INCREMENTAL;
+  else if (!strcmp("generational", gc_mode))
+    self->gc_mode = LUA_DEST_GC_GENERATIONAL;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+void
+lua_dd_set_gc_pause(LogDriver *d, gint gc_pause)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->gc_pause = gc_pause;
+}
+
+void
+lua_dd_set_gc_step_multiplier(LogDriver *d, gint gc_step_multiplier)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->gc_step_multiplier = gc_step_multiplier;
+}
+
+void
+lua_dd_set_persist_state(LogDriver *d, gboolean persist_state)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->persist_state = persist_state;
+}
+
+void
+lua_dd_set_memory_limit(LogDriver *d, gint64 memory_limit)
+{
+  LuaDestDriver *self = (LuaDestDriver *) d;
+
+  self->memory_limit = memory_limit;
+}
+
 void
 lua_dd_init_global_contants(LogDriver *d)
 {
@@ -537,9 +2067,6 @@ lua_dd_new(GlobalConfig *cfg)
 {
   LuaDestDriver *self = g_new0(LuaDestDriver, 1);
 
-  self->state = luaL_newstate();
-  luaL_openlibs(self->state);
-
   log_threaded_dest_driver_init_instance(&self->super, cfg);
   self->super.super.super.super.init = lua_dd_init;
   self->super.super.super.super.deinit = lua_dd_deinit;
@@ -548,6 +2075,22 @@ lua_dd_new(GlobalConfig *cfg)
 
   self->super.worker.insert = lua_dd_queue;
   self->super.worker.disconnect = NULL;
+  self->super.worker.worker_message_queue_empty = lua_dd_worker_message_queue_empty;
+  self->super.worker.thread_init = lua_dd_worker_thread_init;
+  self->super.worker.thread_deinit = lua_dd_worker_thread_deinit;
+
+  self->batch = g_ptr_array_new();
+  self->queued = g_ptr_array_new();
+  self->workers = g_ptr_array_new();
+  self->in_flight = g_ptr_array_new();
+  self->replies = g_async_queue_new();
+  IV_TIMER_INIT(&self->batch_timer);
+  self->batch_timer.cookie = self;
+  self->batch_timer.handler = lua_dd_batch_timer_expired;
+
+  IV_TIMER_INIT(&self->async_timer);
+  self->async_timer.cookie = self;
+  self->async_timer.handler = lua_dd_async_timer_expired;
 
   self->super.format.stats_instance = lua_dd_format_stats_instance;
   self->super.stats_source = SCS_LUA;
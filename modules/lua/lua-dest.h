@@ -30,20 +30,48 @@
 #include "value-pairs/value-pairs.h"
 #include "logthrdestdrv.h"
 #include <lua.h>
+#include <iv.h>
 
 typedef struct _LuaDestDriver
 {
   LogThrDestDriver super;
-  lua_State *state;
+  gint num_workers;
+  GPtrArray *workers;
+  GAsyncQueue *replies;
+  gboolean async;
+  gint max_in_flight;
+  gint async_timeout;
+  GPtrArray *in_flight;
+  struct iv_timer async_timer;
+  StatsCounterItem *call_count;
+  StatsCounterItem *call_errors;
+  StatsCounterItem *call_time;
+  StatsCounterItem *max_call_time;
+  StatsCounterItem *heap_size;
   gchar *template_string;
   gchar *filename;
   gchar *init_func_name;
   gchar *queue_func_name;
   gchar *deinit_func_name;
+  gchar *batch_func_name;
+  gchar *flush_func_name;
+  gint batch_size;
+  gint batch_timeout;
+  GPtrArray *batch;
+  gint batch_retries;
+  gboolean batch_retry_pending;
+  GPtrArray *queued;
+  struct iv_timer batch_timer;
   LogTemplate *template;
   LogTemplateOptions template_options;
   gint mode;
   ValuePairs *params;
+  gboolean reuse_params_table;
+  gboolean persist_state;
+  gsize memory_limit;
+  gint gc_mode;
+  gint gc_pause;
+  gint gc_step_multiplier;
   GList *globals;
 } LuaDestDriver;
 
@@ -51,10 +79,24 @@ LogDriver *lua_dd_new(GlobalConfig *cfg);
 void lua_dd_set_init_func(LogDriver *d, gchar *init_func_name);
 void lua_dd_set_queue_func(LogDriver *d, gchar *queue_func_name);
 void lua_dd_set_deinit_func(LogDriver *d, gchar *deinit_func_name);
+void lua_dd_set_batch_func(LogDriver *d, gchar *batch_func_name);
+void lua_dd_set_flush_func(LogDriver *d, gchar *flush_func_name);
+void lua_dd_set_batch_size(LogDriver *d, gint batch_size);
+void lua_dd_set_batch_timeout(LogDriver *d, gint batch_timeout);
+void lua_dd_set_workers(LogDriver *d, gint num_workers);
+void lua_dd_set_async(LogDriver *d, gboolean async);
+void lua_dd_set_max_in_flight(LogDriver *d, gint max_in_flight);
+void lua_dd_set_async_timeout(LogDriver *d, gint async_timeout);
 void lua_dd_set_filename(LogDriver *d, gchar *filename);
 void lua_dd_set_template(LogDriver *d, LogTemplate *template);
 void lua_dd_set_mode(LogDriver *d, gchar *mode);
 void lua_dd_set_params(LogDriver *d, ValuePairs *vp);
+void lua_dd_set_reuse_params_table(LogDriver *d, gboolean reuse);
+void lua_dd_set_persist_state(LogDriver *d, gboolean persist_state);
+void lua_dd_set_memory_limit(LogDriver *d, gint64 memory_limit);
+gboolean lua_dd_set_gc_mode(LogDriver *d, const gchar *gc_mode);
+void lua_dd_set_gc_pause(LogDriver *d, gint gc_pause);
+void lua_dd_set_gc_step_multiplier(LogDriver *d, gint gc_step_multiplier);
 void lua_dd_add_global_constant(LogDriver *d, const char *name, const char *value);
 void lua_dd_add_global_constant_with_type_hint(LogDriver *d, const char *name, const char *value, const char *type_hint);
 void lua_dd_init_global_contants(LogDriver *d);
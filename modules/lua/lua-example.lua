@@ -12,3 +12,56 @@ function test_queue_raw(msg)
 	counter = counter + 1
 	print(msg['MESSAGE'] .. " " .. tostring(counter))
 end
+
+-- With LuaJIT, Message.ffi reads values without copying them into the
+-- Lua heap; handles are looked up once, at init time
+function test_init_ffi()
+	test_init()
+	message_handle = Message.ffi.handle("MESSAGE")
+end
+
+function test_queue_ffi(msg)
+	counter = counter + 1
+	local ptr, len = Message.ffi.value(Message.ffi.msg(msg), message_handle)
+	io.write(ptr ~= nil and len or 0, " bytes ", tostring(counter), "\n")
+end
+
+-- Handles skip the name lookup on every access; note that the get and
+-- set methods shadow message fields with the same name
+function test_queue_raw_handle(msg)
+	program_handle = program_handle or Message.handle("PROGRAM")
+	counter = counter + 1
+	print(msg:get(program_handle) .. " " .. tostring(counter))
+end
+
+-- Template.new() is cached by template string, format_into() appends to
+-- a reusable buffer instead of creating a Lua string per message
+function test_queue_raw_buffer(msg)
+	local buf = line_buffer or Template.buffer()
+	line_buffer = buf
+	buf:clear()
+	Template.new("${PROGRAM}: ${MESSAGE}"):format_into(buf, msg)
+	print(buf:tostring())
+end
+
+-- syslogng.json_encode() serializes the message in C; the ValuePairs
+-- object takes the same arguments as $(format-json)
+function test_queue_raw_json(msg)
+	json_pairs = json_pairs or ValuePairs.new("--scope rfc5424 --key PROGRAM --pair @message=${MESSAGE}")
+	print(syslogng.json_encode(msg, json_pairs))
+end
+
+-- Used as parser: called with the message and the input of the parser
+-- (the formatted template, $MESSAGE by default); returning false means
+-- the message is not passed on
+function test_parse(msg, input)
+	local user = string.match(input, "user=(%S+)")
+	if not user then
+		return false
+	end
+	msg['user'] = user
+	if syslogng.log_enabled("debug") then
+		syslogng.log("debug", "Lua parser extracted user", { user = user, length = #input })
+	end
+	return true
+end
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013, 2014 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2013, 2014 Viktor Tusa <tusa@balabit.hu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As an additional exemption you are allowed to compile & link against the
+ * OpenSSL libraries as published by the OpenSSL project. See the file
+ * COPYING for details.
+ *
+ */
+
+
+#include "lua-log-parser.h"
+#include "lua-msg.h"
+#include "lua-template.h"
+#include "lua-utils.h"
+#include "lua-value-pairs.h"
+#include "messages.h"
+#include <lauxlib.h>
+#include <lualib.h>
+
+/*
+ * A parser calling a Lua function for every message, with the Message
+ * object and the input of the parser as arguments. The function can
+ * change the message in place; returning false means the message did not
+ * match, so it is not passed on.
+ *
+ * A lua_State can only be used by one thread at a time, so states are
+ * kept in a pool: a thread processing a message takes one (or creates a
+ * new one when all of them are in use) and gives it back afterwards. The
+ * pool grows to the number of threads running the parser concurrently.
+ */
+typedef struct _LuaLogParser
+{
+  LogParser super;
+  gchar *filename;
+  gchar *init_func_name;
+  gchar *parse_func_name;
+  gchar *deinit_func_name;
+  GAsyncQueue *states;
+} LuaLogParser;
+
+static gboolean
+lua_log_parser_call_function(LuaLogParser *self, lua_State *state, const gchar *function_name)
+{
+  if (!function_name)
+    return TRUE;
+
+  lua_getglobal(state, function_name);
+  if (lua_pcall(state, 0, 0, 0))
+    {
+      msg_error("Error happened during calling Lua parser function!",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("function_name", function_name),
+                evt_tag_str("filename", self->filename),
+                NULL);
+      lua_pop(state, 1);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static lua_State *
+lua_log_parser_create_state(LuaLogParser *self)
+{
+  lua_State *state = luaL_newstate();
+
+  luaL_openlibs(state);
+  lua_register_cached_searcher(state);
+
+  if (lua_load_file_cached(state, self->filename) || lua_pcall(state, 0, 0, 0))
+    {
+      msg_error("Error parsing lua script file for lua parser",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("filename", self->filename),
+                NULL);
+      lua_close(state);
+      return NULL;
+    }
+
+  lua_register_message(state);
+  lua_register_template_class(state);
+  lua_register_utility_functions(state);
+  lua_register_value_pairs(state);
+
+  lua_pushlightuserdata(state, log_pipe_get_config(&self->super.super));
+  lua_setglobal(state, "__conf");
+
+  if (!lua_check_existence_of_global_variable(state, self->parse_func_name))
+    {
+      msg_error("Lua parser function cannot be found",
+                evt_tag_str("parse_func", self->parse_func_name),
+                evt_tag_str("filename", self->filename),
+                NULL);
+      lua_close(state);
+      return NULL;
+    }
+
+  if (!lua_log_parser_call_function(self, state, self->init_func_name))
+    {
+      lua_close(state);
+      return NULL;
+    }
+  return state;
+}
+
+static void
+lua_log_parser_free_state(LuaLogParser *self, lua_State *state)
+{
+  lua_log_parser_call_function(self, state, self->deinit_func_name);
+  lua_close(state);
+}
+
+static gboolean
+lua_log_parser_process(LogParser *s, LogMessage **pmsg, const LogPathOptions *path_options,
+                       const gchar *input, gsize input_len)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+  lua_State *state = g_async_queue_try_pop(self->states);
+  LogMessage *msg;
+  gboolean success;
+
+  if (!state)
+    {
+      state = lua_log_parser_create_state(self);
+      if (!state)
+        return FALSE;
+    }
+
+  msg = log_msg_make_writable(pmsg, path_options);
+
+  lua_getglobal(state, self->parse_func_name);
+  lua_message_create_from_logmsg(state, msg);
+  lua_pushlstring(state, input, input_len);
+
+  if (lua_pcall(state, 2, 1, 0))
+    {
+      msg_error("Error happened during calling Lua parser function!",
+                evt_tag_str("error", lua_tostring(state, -1)),
+                evt_tag_str("parse_func", self->parse_func_name),
+                evt_tag_str("filename", self->filename),
+                NULL);
+      success = FALSE;
+    }
+  else
+    {
+      success = !lua_isboolean(state, -1) || lua_toboolean(state, -1);
+    }
+  lua_pop(state, 1);
+
+  g_async_queue_push(self->states, state);
+  return success;
+}
+
+void
+lua_log_parser_set_filename(LogParser *s, const gchar *filename)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+
+  g_free(self->filename);
+  self->filename = g_strdup(filename);
+}
+
+void
+lua_log_parser_set_init_func(LogParser *s, const gchar *init_func_name)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+
+  g_free(self->init_func_name);
+  self->init_func_name = g_strdup(init_func_name);
+}
+
+void
+lua_log_parser_set_parse_func(LogParser *s, const gchar *parse_func_name)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+
+  g_free(self->parse_func_name);
+  self->parse_func_name = g_strdup(parse_func_name);
+}
+
+void
+lua_log_parser_set_deinit_func(LogParser *s, const gchar *deinit_func_name)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+
+  g_free(self->deinit_func_name);
+  self->deinit_func_name = g_strdup(deinit_func_name);
+}
+
+static gboolean
+lua_log_parser_init(LogPipe *s)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+  lua_State *state;
+
+  if (!self->filename)
+    {
+      msg_error("No script set for lua parser", NULL);
+      return FALSE;
+    }
+
+  if (!self->parse_func_name)
+    self->parse_func_name = g_strdup("lua_parse_func");
+
+  /* the first state is created here, so errors in the script are reported at startup */
+  state = lua_log_parser_create_state(self);
+  if (!state)
+    return FALSE;
+  g_async_queue_push(self->states, state);
+
+  return TRUE;
+}
+
+static gboolean
+lua_log_parser_deinit(LogPipe *s)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+  lua_State *state;
+
+  while ((state = g_async_queue_try_pop(self->states)))
+    lua_log_parser_free_state(self, state);
+
+  return TRUE;
+}
+
+static LogPipe *
+lua_log_parser_clone(LogPipe *s)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+  LogParser *cloned = lua_log_parser_new(log_pipe_get_config(s));
+
+  log_parser_set_template(cloned, log_template_ref(self->super.template));
+  lua_log_parser_set_filename(cloned, self->filename);
+  lua_log_parser_set_init_func(cloned, self->init_func_name);
+  lua_log_parser_set_parse_func(cloned, self->parse_func_name);
+  lua_log_parser_set_deinit_func(cloned, self->deinit_func_name);
+  return &cloned->super;
+}
+
+static void
+lua_log_parser_free(LogPipe *s)
+{
+  LuaLogParser *self = (LuaLogParser *) s;
+
+  g_free(self->filename);
+  g_free(self->init_func_name);
+  g_free(self->parse_func_name);
+  g_free(self->deinit_func_name);
+  g_async_queue_unref(self->states);
+  log_parser_free_method(s);
+}
+
+LogParser *
+lua_log_parser_new(GlobalConfig *cfg)
+{
+  LuaLogParser *self = g_new0(LuaLogParser, 1);
+
+  log_parser_init_instance(&self->super, cfg);
+  self->super.super.init = lua_log_parser_init;
+  self->super.super.deinit = lua_log_parser_deinit;
+  self->super.super.clone = lua_log_parser_clone;
+  self->super.super.free_fn = lua_log_parser_free;
+  self->super.process = lua_log_parser_process;
+
+  self->states = g_async_queue_new();
+  return &self->super;
+}
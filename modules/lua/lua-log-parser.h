@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013, 2014 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2013, 2014 Viktor Tusa <tusa@balabit.hu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As an additional exemption you are allowed to compile & link against the
+ * OpenSSL libraries as published by the OpenSSL project. See the file
+ * COPYING for details.
+ *
+ */
+
+
+#ifndef _LUA_LOG_PARSER_H
+#define _LUA_LOG_PARSER_H
+
+#include "parser/parser-expr.h"
+
+LogParser *lua_log_parser_new(GlobalConfig *cfg);
+void lua_log_parser_set_filename(LogParser *s, const gchar *filename);
+void lua_log_parser_set_init_func(LogParser *s, const gchar *init_func_name);
+void lua_log_parser_set_parse_func(LogParser *s, const gchar *parse_func_name);
+void lua_log_parser_set_deinit_func(LogParser *s, const gchar *deinit_func_name);
+
+#endif
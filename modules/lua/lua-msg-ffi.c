@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2013, 2014 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2013, 2014 Viktor Tusa <tusa@balabit.hu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As an additional exemption you are allowed to compile & link against the
+ * OpenSSL libraries as published by the OpenSSL project. See the file
+ * COPYING for details.
+ *
+ */
+
+
+#include "lua-msg-ffi.h"
+#include "lua-msg.h"
+#include "messages.h"
+#include <lauxlib.h>
+#include <string.h>
+
+#if ENABLE_LUAJIT
+
+/*
+ * Zero-copy message access for LuaJIT. The C functions below are handed to
+ * the script as plain pointers and called through the FFI, so reading a
+ * value returns a pointer into the NVTable instead of a new Lua string.
+ * The pointers are only valid while the message is being processed.
+ */
+
+static const gchar *
+lua_message_ffi_get_value(LogMessage *msg, NVHandle handle, gssize *value_len)
+{
+  return log_msg_get_value(msg, handle, value_len);
+}
+
+static NVHandle
+lua_message_ffi_get_value_handle(const gchar *name)
+{
+  return log_msg_get_value_handle(name);
+}
+
+static const gchar *lua_message_ffi_chunk =
+  "local fns = ...\n"
+  "local ffi = require('ffi')\n"
+  "ffi.cdef[[\n"
+  "  typedef struct { const char *ptr; ssize_t len; } syslogng_value_view;\n"
+  "]]\n"
+  "local get_value = ffi.cast('const char *(*)(void *, uint32_t, ssize_t *)', fns.get_value)\n"
+  "local get_value_handle = ffi.cast('uint32_t (*)(const char *)', fns.get_value_handle)\n"
+  "local value_len = ffi.new('ssize_t[1]')\n"
+  "local M = {}\n"
+  "function M.handle(name) return get_value_handle(name) end\n"
+  "function M.msg(msg) return ffi.cast('void **', msg)[0] end\n"
+  "function M.view(m, handle, view)\n"
+  "  view = view or ffi.new('syslogng_value_view')\n"
+  "  view.ptr = get_value(m, handle, value_len)\n"
+  "  view.len = value_len[0]\n"
+  "  return view\n"
+  "end\n"
+  "function M.value(m, handle)\n"
+  "  local ptr = get_value(m, handle, value_len)\n"
+  "  return ptr, tonumber(value_len[0])\n"
+  "end\n"
+  "function M.string(m, handle)\n"
+  "  local ptr = get_value(m, handle, value_len)\n"
+  "  return ffi.string(ptr, value_len[0])\n"
+  "end\n"
+  "return M\n";
+
+void
+lua_message_register_ffi(lua_State *state)
+{
+  if (luaL_loadbuffer(state, lua_message_ffi_chunk, strlen(lua_message_ffi_chunk), "=lua-msg-ffi"))
+    goto error;
+
+  lua_newtable(state);
+  lua_pushlightuserdata(state, (void *) lua_message_ffi_get_value);
+  lua_setfield(state, -2, "get_value");
+  lua_pushlightuserdata(state, (void *) lua_message_ffi_get_value_handle);
+  lua_setfield(state, -2, "get_value_handle");
+
+  if (lua_pcall(state, 1, 1, 0))
+    goto error;
+
+  lua_getglobal(state, "Message");
+  lua_pushvalue(state, -2);
+  lua_setfield(state, -2, "ffi");
+  lua_pop(state, 2);
+  return;
+
+error:
+  msg_error("Error registering the FFI message accessors",
+            evt_tag_str("error", lua_tostring(state, -1)),
+            NULL);
+  lua_pop(state, 1);
+}
+
+#else
+
+void
+lua_message_register_ffi(lua_State *state)
+{
+}
+
+#endif
@@ -24,6 +24,7 @@
 #define LUA_COMPAT_MODULE
 
 #include "lua-msg.h"
+#include "lua-msg-ffi.h"
 #include "lua-utils.h"
 #include "logmsg/logmsg.h"
 #include "messages.h"
@@ -57,42 +58,117 @@ lua_message_get_timestamp(lua_State *state)
   return 1;
 }
 
+/* handles that were never allocated in the name-value registry have no name */
+static NVHandle
+lua_message_check_handle(lua_State *state, int index)
+{
+  lua_Integer handle = luaL_checkinteger(state, index);
+
+  luaL_argcheck(state, handle > 0 && handle <= G_MAXUINT32 &&
+                log_msg_get_value_name((NVHandle) handle, NULL) != NULL,
+                index, "invalid value handle");
+  return (NVHandle) handle;
+}
+
+static LogMessage *
+lua_message_check(lua_State *state, int index)
+{
+  LogMessage *m = lua_check_and_convert_userdata(state, index, LUA_MESSAGE_TYPE);
+
+  if (!m)
+    luaL_argerror(state, index, "Message expected");
+  return m;
+}
+
 static int
-lua_message_metatable__new_index(lua_State *state)
+lua_message_push_value(lua_State *state, LogMessage *m, NVHandle handle)
+{
+  gssize value_len;
+  const char *value = log_msg_get_value(m, handle, &value_len);
+
+  lua_pushlstring(state, value, value_len);
+  return 1;
+}
+
+static int
+lua_message_set_value(lua_State *state, LogMessage *m, NVHandle handle, int index)
 {
   gsize value_len = 0;
-  LogMessage *m = lua_check_and_convert_userdata(state, 1, LUA_MESSAGE_TYPE);
+  const char *value = lua_tolstring(state, index, &value_len);
+
+  log_msg_set_value(m, handle, value, value_len);
+  return 0;
+}
+
+/*
+ * Message.handle("NAME") returns the value handle of a name. Scripts can
+ * look it up once and use msg:get(handle) or msg:set(handle, value) later,
+ * which skip the lookup in the global name registry. msg[key] always takes
+ * the key as a name, msg[1] is the first match group.
+ */
+static int
+lua_message_handle(lua_State *state)
+{
+  const char *name = luaL_checkstring(state, 1);
+
+  lua_pushinteger(state, log_msg_get_value_handle(name));
+  return 1;
+}
+
+static int
+lua_message_get(lua_State *state)
+{
+  LogMessage *m = lua_message_check(state, 1);
 
-  const char *key = lua_tostring(state, 2);
-  const char *value = lua_tolstring(state, 3, &value_len);
+  return lua_message_push_value(state, m, lua_message_check_handle(state, 2));
+}
+
+static int
+lua_message_set(lua_State *state)
+{
+  LogMessage *m = lua_message_check(state, 1);
+
+  return lua_message_set_value(state, m, lua_message_check_handle(state, 2), 3);
+}
+
+static int
+lua_message_metatable__new_index(lua_State *state)
+{
+  LogMessage *m = lua_check_and_convert_userdata(state, 1, LUA_MESSAGE_TYPE);
+  const char *key;
+  NVHandle nv_handle;
 
-  NVHandle nv_handle = log_msg_get_value_handle(key);
+  key = lua_tostring(state, 2);
+  nv_handle = log_msg_get_value_handle(key);
 
   msg_trace("Setting value to lua message",
             evt_tag_str("key",key),
-            evt_tag_str("value",value),
+            evt_tag_str("value",lua_tostring(state, 3)),
             NULL);
-  log_msg_set_value(m, nv_handle, value, value_len);
-  return 0;
+  return lua_message_set_value(state, m, nv_handle, 3);
 }
 
+/* upvalue 1 is the table of methods, they shadow fields of the same name */
 static int
 lua_message_metatable__index(lua_State *state)
 {
-  gssize value_len;
   LogMessage *m = lua_check_and_convert_userdata(state, 1, LUA_MESSAGE_TYPE);
-  const char *key = lua_tostring(state, 2);
+  const char *key;
+  NVHandle handle;
 
-  NVHandle handle = log_msg_get_value_handle(key);
-  const char *value = log_msg_get_value(m, handle, &value_len);
+  lua_pushvalue(state, 2);
+  lua_rawget(state, lua_upvalueindex(1));
+  if (!lua_isnil(state, -1))
+    return 1;
+  lua_pop(state, 1);
+
+  key = lua_tostring(state, 2);
+  handle = log_msg_get_value_handle(key);
 
   msg_trace("Getting value from lua message",
             evt_tag_str("key",key),
-            evt_tag_str("value",value),
             NULL);
-  lua_pushlstring(state, value, value_len);
-
-  return 1;
+  return lua_message_push_value(state, m, handle);
 }
 
 static int
@@ -115,6 +191,16 @@ static const struct luaL_Reg msg_function [] =
 {
   {"new", lua_message_new},
   {"get_timestamp", lua_message_get_timestamp},
+  {"handle", lua_message_handle},
+  {"get", lua_message_get},
+  {"set", lua_message_set},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg msg_methods [] =
+{
+  {"get", lua_message_get},
+  {"set", lua_message_set},
   {NULL, NULL}
 };
 
@@ -128,7 +214,9 @@ lua_register_message(lua_State *state)
   lua_settable(state, -3);
 
   lua_pushstring(state, "__index");
-  lua_pushcfunction(state, lua_message_metatable__index);
+  lua_newtable(state);
+  luaL_openlib(state, NULL, msg_methods, 0);
+  lua_pushcclosure(state, lua_message_metatable__index, 1);
   lua_settable(state, -3);
 
   lua_pushstring(state, "__gc");
@@ -137,6 +225,9 @@ lua_register_message(lua_State *state)
 
   lua_pop(state, 1);
   luaL_openlib(state, "Message", msg_function, 0);
+  lua_pop(state, 1);
+
+  lua_message_register_ffi(state);
 
   return 0;
 }
@@ -27,17 +27,32 @@
 #include "lua-grammar.h"
 
 extern int lua_debug;
-int lua_driver_parse(CfgLexer *lexer, LogDriver **instance, gpointer arg);
+int lua_driver_parse(CfgLexer *lexer, void **instance, gpointer arg);
 
 static CfgLexerKeyword lua_keywords[] = {
   { "lua",                      KW_LUA },
   { "script",                   KW_SCRIPT },
+  { "parse_func",               KW_PARSE_FUNC },
   { "init_func",                KW_INIT_FUNC },
   { "queue_func",               KW_QUEUE_FUNC },
   { "deinit_func",              KW_DEINIT_FUNC },
   { "mode",                     KW_LUA_DEST_MODE },
   { "globals",                  KW_GLOBALS },
   { "params",                   KW_PARAMS },
+  { "batch_func",               KW_BATCH_FUNC },
+  { "flush_func",               KW_FLUSH_FUNC },
+  { "batch_size",               KW_BATCH_SIZE },
+  { "batch_timeout",            KW_BATCH_TIMEOUT },
+  { "workers",                  KW_WORKERS },
+  { "reuse_params_table",       KW_REUSE_PARAMS_TABLE },
+  { "async",                    KW_ASYNC },
+  { "max_in_flight",            KW_MAX_IN_FLIGHT },
+  { "async_timeout",            KW_ASYNC_TIMEOUT },
+  { "persist_state",            KW_PERSIST_STATE },
+  { "memory_limit",             KW_MEMORY_LIMIT },
+  { "gc_mode",                  KW_GC_MODE },
+  { "gc_pause",                 KW_GC_PAUSE },
+  { "gc_step_multiplier",       KW_GC_STEP_MULTIPLIER },
   { NULL }
 };
 
@@ -52,4 +67,4 @@ CfgParser lua_parser =
   .cleanup = (void (*)(gpointer)) log_pipe_unref,
 };
 
-CFG_PARSER_IMPLEMENT_LEXER_BINDING(lua_driver_, LogDriver **)
+CFG_PARSER_IMPLEMENT_LEXER_BINDING(lua_driver_, void **)
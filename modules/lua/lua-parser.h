@@ -30,6 +30,6 @@
 
 extern CfgParser lua_parser;
 
-CFG_PARSER_DECLARE_LEXER_BINDING(lua_driver_, LogDriver **)
+CFG_PARSER_DECLARE_LEXER_BINDING(lua_driver_, void **)
 
 #endif
@@ -29,17 +29,24 @@
 
 extern CfgParser lua_parser;
 
-static Plugin lua_plugin =
+static Plugin lua_plugins[] =
 {
-  .type = LL_CONTEXT_DESTINATION,
-  .name = "lua",
-  .parser = &lua_parser,
+  {
+    .type = LL_CONTEXT_DESTINATION,
+    .name = "lua",
+    .parser = &lua_parser,
+  },
+  {
+    .type = LL_CONTEXT_PARSER,
+    .name = "lua",
+    .parser = &lua_parser,
+  },
 };
 
 gboolean
 lua_module_init(PluginContext *context, CfgArgs *args G_GNUC_UNUSED)
 {
-  plugin_register(context, &lua_plugin, 1);
+  plugin_register(context, lua_plugins, G_N_ELEMENTS(lua_plugins));
   return TRUE;
 }
 
@@ -47,8 +54,8 @@ const ModuleInfo module_info =
 {
   .canonical_name = "lua",
   .version = SYSLOG_NG_VERSION,
-  .description = "The lua module provides lua scripted destination support for syslog-ng.",
+  .description = "The lua module provides lua scripted destination and parser support for syslog-ng.",
   .core_revision = VERSION_CURRENT_VER_ONLY,
-  .plugins = &lua_plugin,
-  .plugins_len = 1,
+  .plugins = lua_plugins,
+  .plugins_len = G_N_ELEMENTS(lua_plugins),
 };
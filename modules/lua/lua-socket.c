@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2013, 2014 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2013, 2014 Viktor Tusa <tusa@balabit.hu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As an additional exemption you are allowed to compile & link against the
+ * OpenSSL libraries as published by the OpenSSL project. See the file
+ * COPYING for details.
+ *
+ */
+
+
+#define LUA_COMPAT_MODULE
+
+#include "lua-socket.h"
+#include "lua-utils.h"
+#include "messages.h"
+#include <lauxlib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LUA_SOCKET_TYPE "SyslogNG.Socket"
+
+/*
+ * Non-blocking TCP sockets for scripts. The C primitives never block, they
+ * return "wait" when the operation would block. The Lua wrappers below
+ * then yield the file descriptor and the awaited event to the destination,
+ * which resumes the coroutine once the socket is ready. Outside of a
+ * coroutine the wrappers wait with poll() instead, so the same code works
+ * in synchronous mode too.
+ */
+
+typedef struct _LuaSocket
+{
+  int fd;
+} LuaSocket;
+
+static int
+lua_socket_push_error(lua_State *state, int err)
+{
+  lua_pushnil(state);
+  if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR)
+    lua_pushstring(state, "wait");
+  else
+    lua_pushstring(state, g_strerror(err));
+  return 2;
+}
+
+static LuaSocket *
+lua_socket_check(lua_State *state, int index)
+{
+  LuaSocket *self = (LuaSocket *) lua_check_and_convert_userdata(state, index, LUA_SOCKET_TYPE);
+
+  if (!self)
+    luaL_argerror(state, index, "socket expected");
+  if (self->fd < 0)
+    luaL_argerror(state, index, "socket is closed");
+  return self;
+}
+
+static int
+lua_socket_connect(lua_State *state)
+{
+  const char *host = luaL_checkstring(state, 1);
+  const char *port = luaL_checkstring(state, 2);
+  struct addrinfo hints, *res, *ai;
+  LuaSocket *self;
+  gboolean pending = FALSE;
+  int fd = -1, err = ECONNREFUSED, rc;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  rc = getaddrinfo(host, port, &hints, &res);
+  if (rc != 0)
+    {
+      lua_pushnil(state);
+      lua_pushstring(state, gai_strerror(rc));
+      return 2;
+    }
+
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        {
+          err = errno;
+          continue;
+        }
+
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      if (errno == EINPROGRESS)
+        {
+          pending = TRUE;
+          break;
+        }
+
+      err = errno;
+      close(fd);
+      fd = -1;
+    }
+  freeaddrinfo(res);
+
+  if (fd < 0)
+    {
+      lua_pushnil(state);
+      lua_pushstring(state, g_strerror(err));
+      return 2;
+    }
+
+  self = g_new0(LuaSocket, 1);
+  self->fd = fd;
+  lua_create_userdata_from_pointer(state, self, LUA_SOCKET_TYPE);
+  lua_pushboolean(state, pending);
+  return 2;
+}
+
+static int
+lua_socket_connect_finish(lua_State *state)
+{
+  LuaSocket *self = lua_socket_check(state, 1);
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(self->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+
+  if (err)
+    {
+      lua_pushnil(state);
+      lua_pushstring(state, g_strerror(err));
+      return 2;
+    }
+
+  lua_pushboolean(state, TRUE);
+  return 1;
+}
+
+static int
+lua_socket_send(lua_State *state)
+{
+  LuaSocket *self = lua_socket_check(state, 1);
+  size_t len;
+  const char *data = luaL_checklstring(state, 2, &len);
+  size_t offset = luaL_optinteger(state, 3, 0);
+  ssize_t rc;
+
+  if (offset >= len)
+    {
+      lua_pushinteger(state, 0);
+      return 1;
+    }
+
+  rc = send(self->fd, data + offset, len - offset, 0);
+  if (rc < 0)
+    return lua_socket_push_error(state, errno);
+
+  lua_pushinteger(state, rc);
+  return 1;
+}
+
+static int
+lua_socket_receive(lua_State *state)
+{
+  LuaSocket *self = lua_socket_check(state, 1);
+  gchar buffer[8192];
+  ssize_t rc;
+
+  rc = recv(self->fd, buffer, sizeof(buffer), 0);
+  if (rc < 0)
+    return lua_socket_push_error(state, errno);
+
+  if (rc == 0)
+    {
+      lua_pushnil(state);
+      lua_pushstring(state, "closed");
+      return 2;
+    }
+
+  lua_pushlstring(state, buffer, rc);
+  return 1;
+}
+
+static int
+lua_socket_fileno(lua_State *state)
+{
+  LuaSocket *self = lua_socket_check(state, 1);
+
+  lua_pushinteger(state, self->fd);
+  return 1;
+}
+
+static int
+lua_socket_close(lua_State *state)
+{
+  LuaSocket *self = (LuaSocket *) lua_check_and_convert_userdata(state, 1, LUA_SOCKET_TYPE);
+
+  if (self && self->fd >= 0)
+    {
+      close(self->fd);
+      self->fd = -1;
+    }
+  return 0;
+}
+
+static int
+lua_socket__gc(lua_State *state)
+{
+  LuaSocket *self = (LuaSocket *) lua_check_and_convert_userdata(state, 1, LUA_SOCKET_TYPE);
+
+  lua_socket_close(state);
+  g_free(self);
+  return 0;
+}
+
+/* blocking wait, used when not running in a coroutine */
+static int
+lua_socket_wait(lua_State *state)
+{
+  struct pollfd pfd;
+  const char *events = luaL_checkstring(state, 2);
+  int rc;
+
+  pfd.fd = luaL_checkinteger(state, 1);
+  pfd.events = (events[0] == 'w') ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+
+  do
+    rc = poll(&pfd, 1, luaL_optinteger(state, 3, -1));
+  while (rc < 0 && errno == EINTR);
+
+  if (rc <= 0)
+    {
+      lua_pushnil(state);
+      lua_pushstring(state, rc == 0 ? "timeout" : g_strerror(errno));
+      return 2;
+    }
+
+  lua_pushboolean(state, TRUE);
+  return 1;
+}
+
+static const struct luaL_Reg socket_functions [] =
+{
+  {"_connect", lua_socket_connect},
+  {"_wait", lua_socket_wait},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg socket_methods [] =
+{
+  {"_connect_finish", lua_socket_connect_finish},
+  {"_send", lua_socket_send},
+  {"_receive", lua_socket_receive},
+  {"fileno", lua_socket_fileno},
+  {"close", lua_socket_close},
+  {"__gc", lua_socket__gc},
+  {NULL, NULL}
+};
+
+static const gchar *lua_socket_chunk =
+  "local S = ...\n"
+  "S.timeout = 30\n"
+  "local function wait(fd, events)\n"
+  "  local co, main = coroutine.running()\n"
+  "  if co == nil or main then\n"
+  "    local ok, err = S._wait(fd, events, S.timeout * 1000)\n"
+  "    if not ok then error(err) end\n"
+  "  else\n"
+  "    coroutine.yield(fd, events)\n"
+  "  end\n"
+  "end\n"
+  "local Sock = {}\n"
+  "Sock.__index = Sock\n"
+  "function S.connect(host, port)\n"
+  "  local raw, pending = S._connect(host, tostring(port))\n"
+  "  if not raw then return nil, pending end\n"
+  "  if pending then\n"
+  "    wait(raw:fileno(), 'w')\n"
+  "    local ok, err = raw:_connect_finish()\n"
+  "    if not ok then raw:close() return nil, err end\n"
+  "  end\n"
+  "  return setmetatable({ raw = raw, buffer = '' }, Sock)\n"
+  "end\n"
+  "function Sock:send(data)\n"
+  "  local offset = 0\n"
+  "  while offset < #data do\n"
+  "    local n, err = self.raw:_send(data, offset)\n"
+  "    if n then offset = offset + n\n"
+  "    elseif err == 'wait' then wait(self.raw:fileno(), 'w')\n"
+  "    else return nil, err end\n"
+  "  end\n"
+  "  return #data\n"
+  "end\n"
+  "function Sock:fill()\n"
+  "  while true do\n"
+  "    local data, err = self.raw:_receive()\n"
+  "    if data then self.buffer = self.buffer .. data return true end\n"
+  "    if err ~= 'wait' then return nil, err end\n"
+  "    wait(self.raw:fileno(), 'r')\n"
+  "  end\n"
+  "end\n"
+  "function Sock:receive(pattern)\n"
+  "  pattern = pattern or '*l'\n"
+  "  while true do\n"
+  "    if pattern == '*l' then\n"
+  "      local i = self.buffer:find('\\n', 1, true)\n"
+  "      if i then\n"
+  "        local line = self.buffer:sub(1, i - 1)\n"
+  "        self.buffer = self.buffer:sub(i + 1)\n"
+  "        return (line:gsub('\\r$', ''))\n"
+  "      end\n"
+  "    elseif type(pattern) == 'number' and #self.buffer >= pattern then\n"
+  "      local data = self.buffer:sub(1, pattern)\n"
+  "      self.buffer = self.buffer:sub(pattern + 1)\n"
+  "      return data\n"
+  "    end\n"
+  "    local ok, err = self:fill()\n"
+  "    if not ok then\n"
+  "      if err == 'closed' and pattern == '*a' then\n"
+  "        local data = self.buffer\n"
+  "        self.buffer = ''\n"
+  "        return data\n"
+  "      end\n"
+  "      return nil, err\n"
+  "    end\n"
+  "  end\n"
+  "end\n"
+  "function Sock:close() self.raw:close() end\n"
+  "function S.http_request(req)\n"
+  "  local sock, err = S.connect(req.host, req.port or 80)\n"
+  "  if not sock then return nil, err end\n"
+  "  local body = req.body or ''\n"
+  "  local lines = { (req.method or 'GET') .. ' ' .. (req.path or '/') .. ' HTTP/1.0',\n"
+  "                  'Host: ' .. req.host, 'Content-Length: ' .. #body }\n"
+  "  for k, v in pairs(req.headers or {}) do lines[#lines + 1] = k .. ': ' .. v end\n"
+  "  local ok\n"
+  "  ok, err = sock:send(table.concat(lines, '\\r\\n') .. '\\r\\n\\r\\n' .. body)\n"
+  "  if not ok then sock:close() return nil, err end\n"
+  "  local response\n"
+  "  response, err = sock:receive('*a')\n"
+  "  sock:close()\n"
+  "  if not response then return nil, err end\n"
+  "  local head, rest = response:match('^(.-)\\r\\n\\r\\n(.*)$')\n"
+  "  if not head then return nil, 'malformed HTTP response' end\n"
+  "  local headers = {}\n"
+  "  for k, v in head:gmatch('\\r\\n([^:\\r\\n]+):%s*([^\\r\\n]*)') do headers[k:lower()] = v end\n"
+  "  return tonumber(head:match('^HTTP/%d%.%d (%d%d%d)')), rest, headers\n"
+  "end\n"
+  "return S\n";
+
+void
+lua_register_socket(lua_State *state)
+{
+  luaL_newmetatable(state, LUA_SOCKET_TYPE);
+
+  lua_pushstring(state, "__index");
+  lua_pushvalue(state, -2);
+  lua_settable(state, -3);
+
+  luaL_openlib(state, NULL, socket_methods, 0);
+
+  lua_pop(state, 1);
+
+  if (luaL_loadbuffer(state, lua_socket_chunk, strlen(lua_socket_chunk), "=lua-socket"))
+    goto error;
+
+  lua_newtable(state);
+  luaL_openlib(state, NULL, socket_functions, 0);
+
+  if (lua_pcall(state, 1, 1, 0))
+    goto error;
+
+  lua_setglobal(state, "Socket");
+  return;
+
+error:
+  msg_error("Error registering the Lua socket functions",
+            evt_tag_str("error", lua_tostring(state, -1)),
+            NULL);
+  lua_pop(state, 1);
+}
@@ -32,9 +32,18 @@
 #include <lualib.h>
 
 #define LUA_TEMPLATE_TYPE "SyslogNG.Template"
+#define LUA_TEMPLATE_BUFFER_TYPE "SyslogNG.TemplateBuffer"
+#define LUA_TEMPLATE_CACHE "SyslogNG.TemplateCache"
 
 #define LUA_COMPAT_MODULE
 
+/*
+ * Compiled templates are cached per Lua state, keyed by the template
+ * string, so calling Template.new() in the queue function is cheap. The
+ * cache holds its values weakly; templates no longer referenced by the
+ * script are collected. It is not shared between states, as a template
+ * belongs to the configuration it was compiled with.
+ */
 int
 lua_template_new(lua_State *state)
 {
@@ -42,17 +51,37 @@ lua_template_new(lua_State *state)
   LogTemplate *template;
   const char *template_string;
   GError *error = NULL;
+  int string_index, cache_index;
 
-  cfg = lua_get_config_from_current_state(state);
   template_string = lua_tostring(state, -1);
+  string_index = lua_gettop(state);
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_TEMPLATE_CACHE);
+  cache_index = lua_gettop(state);
+  lua_pushvalue(state, string_index);
+  lua_rawget(state, cache_index);
+  if (!lua_isnil(state, -1))
+    return 1;
+  lua_pop(state, 1);
+
+  cfg = lua_get_config_from_current_state(state);
 
   template = log_template_new(cfg, NULL);
   log_template_compile(template, template_string, &error);
   if (error != NULL)
   {
-     return luaL_error(state, "%s", error->message);
+     lua_pushstring(state, error->message);
+     g_error_free(error);
+     log_template_unref(template);
+     return lua_error(state);
   }
-  return lua_create_userdata_from_pointer(state, template, LUA_TEMPLATE_TYPE);
+
+  lua_create_userdata_from_pointer(state, template, LUA_TEMPLATE_TYPE);
+  lua_track_config_object(state, 1);
+  lua_pushvalue(state, string_index);
+  lua_pushvalue(state, -2);
+  lua_rawset(state, cache_index);
+  return 1;
 };
 
 static int
@@ -62,6 +91,7 @@ lua_template_metatable__gc(lua_State *state)
 
   template = (LogTemplate *) lua_check_and_convert_userdata(state, -1, LUA_TEMPLATE_TYPE);
   log_template_unref(template);
+  lua_track_config_object(state, -1);
 
   return 0;
 }
@@ -82,19 +112,138 @@ lua_template_format(lua_State *state)
   return 1;
 }
 
+/*
+ * Template.buffer() returns a growable string buffer, tmpl:format_into()
+ * appends to it, so a batch can be rendered without creating a Lua
+ * string per message.
+ */
+static int
+lua_template_buffer_new(lua_State *state)
+{
+  return lua_create_userdata_from_pointer(state, g_string_sized_new(256), LUA_TEMPLATE_BUFFER_TYPE);
+}
+
+static GString *
+lua_template_check_buffer(lua_State *state, int index)
+{
+  GString *buffer = (GString *) lua_check_and_convert_userdata(state, index, LUA_TEMPLATE_BUFFER_TYPE);
+
+  if (!buffer)
+    luaL_argerror(state, index, "template buffer expected");
+  return buffer;
+}
+
+static int
+lua_template_format_into(lua_State *state)
+{
+  LogTemplate *template;
+  LogMessage *msg;
+  GString *buffer;
+
+  template = (LogTemplate *) lua_check_and_convert_userdata(state, 1, LUA_TEMPLATE_TYPE);
+  if (!template)
+    return luaL_argerror(state, 1, "Template expected");
+
+  buffer = lua_template_check_buffer(state, 2);
+
+  msg = (LogMessage *) lua_check_and_convert_userdata(state, 3, LUA_MESSAGE_TYPE);
+  if (!msg)
+    return luaL_argerror(state, 3, "Message expected");
+
+  log_template_append_format(template, msg, NULL, 0, 0, NULL, buffer);
+  lua_settop(state, 2);
+
+  return 1;
+}
+
+static int
+lua_template_buffer_append(lua_State *state)
+{
+  GString *buffer = lua_template_check_buffer(state, 1);
+  size_t len;
+  const char *str = luaL_checklstring(state, 2, &len);
+
+  g_string_append_len(buffer, str, len);
+  lua_settop(state, 1);
+
+  return 1;
+}
+
+static int
+lua_template_buffer_tostring(lua_State *state)
+{
+  GString *buffer = lua_template_check_buffer(state, 1);
+
+  lua_pushlstring(state, buffer->str, buffer->len);
+  return 1;
+}
+
+static int
+lua_template_buffer_len(lua_State *state)
+{
+  GString *buffer = lua_template_check_buffer(state, 1);
+
+  lua_pushinteger(state, buffer->len);
+  return 1;
+}
+
+static int
+lua_template_buffer_clear(lua_State *state)
+{
+  GString *buffer = lua_template_check_buffer(state, 1);
+
+  g_string_truncate(buffer, 0);
+  return 0;
+}
+
+static int
+lua_template_buffer__gc(lua_State *state)
+{
+  GString *buffer = (GString *) lua_check_and_convert_userdata(state, 1, LUA_TEMPLATE_BUFFER_TYPE);
+
+  g_string_free(buffer, TRUE);
+  return 0;
+}
+
 static const struct luaL_Reg template_namespace [] =
 {
   {"new", lua_template_new},
+  {"buffer", lua_template_buffer_new},
   {NULL, NULL}
 };
 
 static const struct luaL_Reg template_methods [] =
 {
   {"format", lua_template_format},
+  {"format_into", lua_template_format_into},
   {"__gc", lua_template_metatable__gc},
   {NULL, NULL}
 };
 
+static const struct luaL_Reg template_buffer_methods [] =
+{
+  {"append", lua_template_buffer_append},
+  {"tostring", lua_template_buffer_tostring},
+  {"len", lua_template_buffer_len},
+  {"clear", lua_template_buffer_clear},
+  {"__tostring", lua_template_buffer_tostring},
+  {"__len", lua_template_buffer_len},
+  {"__gc", lua_template_buffer__gc},
+  {NULL, NULL}
+};
+
+/* drops the cached templates, they are collected unless the script still refers to them */
+void
+lua_template_reset_cache(lua_State *state)
+{
+  lua_newtable(state);
+  lua_newtable(state);
+  lua_pushstring(state, "v");
+  lua_setfield(state, -2, "__mode");
+  lua_setmetatable(state, -2);
+  lua_setfield(state, LUA_REGISTRYINDEX, LUA_TEMPLATE_CACHE);
+}
+
 int
 lua_register_template_class(lua_State *state)
 {
@@ -107,6 +256,19 @@ lua_register_template_class(lua_State *state)
   luaL_openlib(state, NULL, template_methods, 0);
 
   lua_pop(state, 1);
+
+  luaL_newmetatable(state, LUA_TEMPLATE_BUFFER_TYPE);
+
+  lua_pushstring(state, "__index");
+  lua_pushvalue(state, -2);
+  lua_settable(state, -3);
+
+  luaL_openlib(state, NULL, template_buffer_methods, 0);
+
+  lua_pop(state, 1);
+
+  lua_template_reset_cache(state);
+
   luaL_openlib(state, "Template", template_namespace, 0);
 
   return 0;
@@ -28,5 +28,6 @@
 #define LUA_TEMPLATE_H_INCLUDED
 
 int lua_register_template_class(lua_State *state);
+void lua_template_reset_cache(lua_State *state);
 #endif
 
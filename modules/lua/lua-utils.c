@@ -26,6 +26,8 @@
 #include "lua-utils.h"
 #include <lauxlib.h>
 #include "messages.h"
+#include <sys/stat.h>
+#include <string.h>
 
 static void *
 lua_get_pointer_from_userdata(void *udata)
@@ -108,6 +110,37 @@ lua_get_config_from_current_state(lua_State *state)
     return result;
 }
 
+/*
+ * Objects compiled against __conf (templates, value-pairs) are counted per
+ * state, so the owner can tell whether the state still refers to the
+ * configuration it was created with.
+ */
+#define LUA_CONFIG_OBJECTS "SyslogNG.ConfigObjects"
+
+void
+lua_track_config_object(lua_State *state, int delta)
+{
+  int count;
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_CONFIG_OBJECTS);
+  count = lua_tointeger(state, -1) + delta;
+  lua_pop(state, 1);
+
+  lua_pushinteger(state, count);
+  lua_setfield(state, LUA_REGISTRYINDEX, LUA_CONFIG_OBJECTS);
+}
+
+int
+lua_count_config_objects(lua_State *state)
+{
+  int count;
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_CONFIG_OBJECTS);
+  count = lua_tointeger(state, -1);
+  lua_pop(state, 1);
+  return count;
+}
+
 static int
 lua_msg_debug(lua_State *state)
 {
@@ -140,12 +173,120 @@ lua_msg_verbose(lua_State *state)
   return 0;
 };
 
+/*
+ * syslogng.log(level, message, tags): tags is a table, its string keyed
+ * pairs are emitted as tags of the internal message. The level is checked
+ * first: when it is disabled, nothing else is looked at, and when message
+ * is a function, it is only called for enabled levels and has to return
+ * the message and the tags, so scripts do not build debug strings that are
+ * thrown away.
+ */
+static gint
+lua_check_log_level(lua_State *state, int index, gboolean *enabled)
+{
+  const char *level = luaL_checkstring(state, index);
+
+  *enabled = TRUE;
+  if (strcmp(level, "trace") == 0)
+    {
+      *enabled = trace_flag;
+      return EVT_PRI_DEBUG;
+    }
+  if (strcmp(level, "debug") == 0)
+    {
+      *enabled = debug_flag;
+      return EVT_PRI_DEBUG;
+    }
+  if (strcmp(level, "info") == 0 || strcmp(level, "verbose") == 0)
+    {
+      *enabled = verbose_flag;
+      return EVT_PRI_INFO;
+    }
+  if (strcmp(level, "notice") == 0)
+    return EVT_PRI_NOTICE;
+  if (strcmp(level, "warning") == 0)
+    return EVT_PRI_WARNING;
+  if (strcmp(level, "error") == 0)
+    return EVT_PRI_ERR;
+  if (strcmp(level, "critical") == 0)
+    return EVT_PRI_CRIT;
+
+  return luaL_argerror(state, index, "unknown log level");
+}
+
+static EVTTAG *
+lua_create_log_tag(lua_State *state, const char *name, int index)
+{
+  lua_Number number;
+
+  switch (lua_type(state, index))
+    {
+    case LUA_TSTRING:
+      return evt_tag_str(name, lua_tostring(state, index));
+    case LUA_TNUMBER:
+      number = lua_tonumber(state, index);
+      if (number == (lua_Number) (glong) number)
+        return evt_tag_long(name, (glong) number);
+      return evt_tag_printf(name, "%.14g", number);
+    case LUA_TBOOLEAN:
+      return evt_tag_str(name, lua_toboolean(state, index) ? "true" : "false");
+    default:
+      return evt_tag_str(name, lua_typename(state, lua_type(state, index)));
+    }
+}
+
+static int
+lua_log(lua_State *state)
+{
+  gboolean enabled;
+  gint prio = lua_check_log_level(state, 1, &enabled);
+  EVTREC *event;
+
+  if (!enabled)
+    return 0;
+
+  lua_settop(state, 3);
+  if (lua_isfunction(state, 2))
+    {
+      lua_pushvalue(state, 2);
+      lua_call(state, 0, 2);
+      lua_replace(state, 3);
+      lua_replace(state, 2);
+    }
+
+  event = msg_event_create(prio, luaL_checkstring(state, 2), NULL);
+  if (lua_istable(state, 3))
+    {
+      lua_pushnil(state);
+      while (lua_next(state, 3))
+        {
+          if (lua_type(state, -2) == LUA_TSTRING)
+            evt_rec_add_tag(event, lua_create_log_tag(state, lua_tostring(state, -2), -1));
+          lua_pop(state, 1);
+        }
+    }
+  msg_event_suppress_recursions_and_send(event);
+  return 0;
+}
+
+static int
+lua_log_enabled(lua_State *state)
+{
+  gboolean enabled;
+
+  lua_check_log_level(state, 1, &enabled);
+  lua_pushboolean(state, enabled);
+  return 1;
+}
+
 static const struct luaL_Reg utility_functions [] =
 {
   {"debug", lua_msg_debug},
   {"error", lua_msg_error},
   {"verbose", lua_msg_verbose},
   {"info", lua_msg_info},
+  {"log", lua_log},
+  {"log_enabled", lua_log_enabled},
 
   {NULL, NULL}
 };
@@ -154,3 +295,187 @@ void lua_register_utility_functions(lua_State *state)
 {
   luaL_openlib(state, "syslogng", utility_functions, 0);
 };
+
+/*
+ * Compiled chunk cache: scripts (and modules loaded by require()) are
+ * parsed once per process, later loads, including the ones after a
+ * reload, reuse the bytecode dumped from the first load. An entry is
+ * invalidated when the modification time, size or inode of the file
+ * changes. Precompiled (luac) files are loaded as they are by
+ * luaL_loadfile().
+ */
+typedef struct _LuaChunkCacheEntry
+{
+  time_t mtime;
+  off_t size;
+  ino_t inode;
+  GByteArray *chunk;
+} LuaChunkCacheEntry;
+
+static GHashTable *lua_chunk_cache;
+static GMutex lua_chunk_cache_lock;
+
+static void
+lua_chunk_cache_entry_free(LuaChunkCacheEntry *entry)
+{
+  g_byte_array_free(entry->chunk, TRUE);
+  g_free(entry);
+}
+
+static int
+lua_chunk_writer(lua_State *state, const void *p, size_t size, void *ud)
+{
+  g_byte_array_append((GByteArray *) ud, p, size);
+  return 0;
+}
+
+int
+lua_load_file_cached(lua_State *state, const gchar *filename)
+{
+  LuaChunkCacheEntry *entry;
+  struct stat st;
+  gchar *chunk_name;
+  int status;
+
+  if (stat(filename, &st) < 0)
+    return luaL_loadfile(state, filename);
+
+  g_mutex_lock(&lua_chunk_cache_lock);
+  if (!lua_chunk_cache)
+    lua_chunk_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) lua_chunk_cache_entry_free);
+
+  entry = g_hash_table_lookup(lua_chunk_cache, filename);
+  if (entry && entry->mtime == st.st_mtime && entry->size == st.st_size && entry->inode == st.st_ino)
+    {
+      chunk_name = g_strdup_printf("@%s", filename);
+      status = luaL_loadbuffer(state, (const char *) entry->chunk->data, entry->chunk->len, chunk_name);
+      g_mutex_unlock(&lua_chunk_cache_lock);
+      g_free(chunk_name);
+      return status;
+    }
+  g_mutex_unlock(&lua_chunk_cache_lock);
+
+  status = luaL_loadfile(state, filename);
+  if (status != 0)
+    return status;
+
+  entry = g_new0(LuaChunkCacheEntry, 1);
+  entry->mtime = st.st_mtime;
+  entry->size = st.st_size;
+  entry->inode = st.st_ino;
+  entry->chunk = g_byte_array_new();
+  if (lua_dump(state, lua_chunk_writer, entry->chunk) != 0)
+    {
+      lua_chunk_cache_entry_free(entry);
+      return 0;
+    }
+
+  g_mutex_lock(&lua_chunk_cache_lock);
+  g_hash_table_replace(lua_chunk_cache, g_strdup(filename), entry);
+  g_mutex_unlock(&lua_chunk_cache_lock);
+  return 0;
+}
+
+/* package.path lookup, as done by the standard Lua file searcher */
+static gchar *
+lua_search_module(const gchar *name, const gchar *path, GString *not_found)
+{
+  gchar *module_path = g_strdelimit(g_strdup(name), ".", G_DIR_SEPARATOR);
+  gchar **templates = g_strsplit(path, ";", -1);
+  gchar *result = NULL;
+  gint i;
+
+  for (i = 0; templates[i] && !result; i++)
+    {
+      gchar **parts;
+      gchar *filename;
+
+      if (templates[i][0] == '\0')
+        continue;
+
+      parts = g_strsplit(templates[i], "?", -1);
+      filename = g_strjoinv(module_path, parts);
+      g_strfreev(parts);
+
+      if (g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+        result = filename;
+      else
+        {
+          g_string_append_printf(not_found, "\n\tno file '%s'", filename);
+          g_free(filename);
+        }
+    }
+
+  g_strfreev(templates);
+  g_free(module_path);
+  return result;
+}
+
+static int
+lua_cached_searcher(lua_State *state)
+{
+  const char *name = luaL_checkstring(state, 1);
+  GString *not_found = g_string_new("");
+  const char *path;
+  gchar *filename;
+
+  lua_getglobal(state, "package");
+  lua_getfield(state, -1, "path");
+  path = lua_tostring(state, -1);
+  filename = path ? lua_search_module(name, path, not_found) : NULL;
+  lua_pop(state, 2);
+
+  if (!filename)
+    {
+      lua_pushstring(state, not_found->str);
+      g_string_free(not_found, TRUE);
+      return 1;
+    }
+  g_string_free(not_found, TRUE);
+
+  if (lua_load_file_cached(state, filename) != 0)
+    {
+      lua_pushfstring(state, "error loading module '%s' from file '%s':\n\t%s",
+                      name, filename, lua_tostring(state, -1));
+      g_free(filename);
+      return lua_error(state);
+    }
+
+  lua_pushstring(state, filename);
+  g_free(filename);
+  return 2;
+}
+
+/* inserts the cached searcher before the standard Lua file searcher */
+void
+lua_register_cached_searcher(lua_State *state)
+{
+  int i, len;
+
+  lua_getglobal(state, "package");
+#if LUA_VERSION_NUM >= 502
+  lua_getfield(state, -1, "searchers");
+#else
+  lua_getfield(state, -1, "loaders");
+#endif
+  if (!lua_istable(state, -1))
+    {
+      lua_pop(state, 2);
+      return;
+    }
+
+#if LUA_VERSION_NUM >= 502
+  len = lua_rawlen(state, -1);
+#else
+  len = lua_objlen(state, -1);
+#endif
+  for (i = len; i >= 2; i--)
+    {
+      lua_rawgeti(state, -1, i);
+      lua_rawseti(state, -2, i + 1);
+    }
+  lua_pushcfunction(state, lua_cached_searcher);
+  lua_rawseti(state, -2, 2);
+  lua_pop(state, 2);
+}
@@ -31,6 +31,10 @@ void *lua_check_and_convert_userdata(lua_State *state, int index, const char *ty
 int lua_create_userdata_from_pointer(lua_State *state, void *data, const char *type);
 gboolean lua_check_existence_of_global_variable(lua_State *state, const char *variable_name);
 GlobalConfig *lua_get_config_from_current_state(lua_State *state);
+void lua_track_config_object(lua_State *state, int delta);
+int lua_count_config_objects(lua_State *state);
 void lua_register_utility_functions(lua_State *state);
+int lua_load_file_cached(lua_State *state, const gchar *filename);
+void lua_register_cached_searcher(lua_State *state);
 
 #endif
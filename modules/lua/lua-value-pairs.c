@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2013, 2014 BalaBit IT Ltd, Budapest, Hungary
+ * Copyright (c) 2013, 2014 Viktor Tusa <tusa@balabit.hu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As an additional exemption you are allowed to compile & link against the
+ * OpenSSL libraries as published by the OpenSSL project. See the file
+ * COPYING for details.
+ *
+ */
+
+
+#define LUA_COMPAT_MODULE
+
+#include "lua-value-pairs.h"
+#include "lua-msg.h"
+#include "lua-utils.h"
+#include "value-pairs/value-pairs.h"
+#include "scratch-buffers.h"
+#include "cfg.h"
+#include <lauxlib.h>
+#include <math.h>
+#include <string.h>
+
+#define LUA_VALUE_PAIRS_DEFAULT_CMDLINE "--scope selected-macros --scope nv-pairs"
+#define LUA_VALUE_PAIRS_DEFAULT "SyslogNG.ValuePairs.Default"
+
+/*
+ * ValuePairs.new(cmdline) compiles a value-pairs specification, with the
+ * same syntax as the arguments of $(format-json); the result can be
+ * passed to syslogng.json_encode(msg, vp), which walks the message the
+ * same way $(format-json) does and returns the document as one string.
+ * Without a value-pairs object, selected macros and name-value pairs are
+ * encoded.
+ */
+static ValuePairs *
+lua_value_pairs_compile(lua_State *state, const char *cmdline)
+{
+  GlobalConfig *cfg = lua_get_config_from_current_state(state);
+  GError *error = NULL;
+  gchar *cmd = g_strdup_printf("json_encode %s", cmdline);
+  gchar **argv = NULL;
+  gint argc;
+  ValuePairs *vp = NULL;
+
+  if (g_shell_parse_argv(cmd, &argc, &argv, &error))
+    vp = value_pairs_new_from_cmdline(cfg, &argc, &argv, FALSE, &error);
+  g_free(cmd);
+  g_strfreev(argv);
+
+  if (!vp)
+    {
+      lua_pushstring(state, error ? error->message : "invalid value-pairs specification");
+      if (error)
+        g_error_free(error);
+      lua_error(state);
+    }
+  return vp;
+}
+
+static int
+lua_value_pairs_new(lua_State *state)
+{
+  ValuePairs *vp = lua_value_pairs_compile(state, luaL_checkstring(state, 1));
+
+  lua_create_userdata_from_pointer(state, vp, LUA_VALUE_PAIRS_TYPE);
+  lua_track_config_object(state, 1);
+  return 1;
+}
+
+static int
+lua_value_pairs_metatable__gc(lua_State *state)
+{
+  ValuePairs *vp = lua_check_and_convert_userdata(state, 1, LUA_VALUE_PAIRS_TYPE);
+
+  value_pairs_unref(vp);
+  lua_track_config_object(state, -1);
+  return 0;
+}
+
+static ValuePairs *
+lua_value_pairs_get_default(lua_State *state)
+{
+  ValuePairs *vp;
+
+  lua_getfield(state, LUA_REGISTRYINDEX, LUA_VALUE_PAIRS_DEFAULT);
+  if (lua_isnil(state, -1))
+    {
+      lua_pop(state, 1);
+      vp = lua_value_pairs_compile(state, LUA_VALUE_PAIRS_DEFAULT_CMDLINE);
+      lua_create_userdata_from_pointer(state, vp, LUA_VALUE_PAIRS_TYPE);
+      lua_track_config_object(state, 1);
+      lua_pushvalue(state, -1);
+      lua_setfield(state, LUA_REGISTRYINDEX, LUA_VALUE_PAIRS_DEFAULT);
+    }
+  vp = lua_check_and_convert_userdata(state, -1, LUA_VALUE_PAIRS_TYPE);
+  lua_pop(state, 1);
+  return vp;
+}
+
+typedef struct _LuaJsonState
+{
+  GString *buffer;
+  gboolean need_comma;
+} LuaJsonState;
+
+static void
+lua_json_append_escaped(GString *buffer, const gchar *str, gssize len)
+{
+  const gchar *end = str + (len < 0 ? strlen(str) : len);
+  const gchar *p;
+
+  g_string_append_c(buffer, '"');
+  for (p = str; p < end; p++)
+    {
+      guchar c = *p;
+
+      switch (c)
+        {
+        case '"':
+          g_string_append(buffer, "\\\"");
+          break;
+        case '\\':
+          g_string_append(buffer, "\\\\");
+          break;
+        case '\n':
+          g_string_append(buffer, "\\n");
+          break;
+        case '\r':
+          g_string_append(buffer, "\\r");
+          break;
+        case '\t':
+          g_string_append(buffer, "\\t");
+          break;
+        default:
+          if (c < 0x20)
+            g_string_append_printf(buffer, "\\u%04x", c);
+          else
+            g_string_append_c(buffer, c);
+          break;
+        }
+    }
+  g_string_append_c(buffer, '"');
+}
+
+static void
+lua_json_append_name(LuaJsonState *state, const gchar *name)
+{
+  if (state->need_comma)
+    g_string_append_c(state->buffer, ',');
+  if (name)
+    {
+      lua_json_append_escaped(state->buffer, name, -1);
+      g_string_append_c(state->buffer, ':');
+    }
+}
+
+static gboolean
+lua_json_obj_start(const gchar *name, const gchar *prefix, gpointer *prefix_data,
+                   const gchar *prev, gpointer *prev_data, gpointer user_data)
+{
+  LuaJsonState *state = (LuaJsonState *) user_data;
+
+  lua_json_append_name(state, name);
+  g_string_append_c(state->buffer, '{');
+  state->need_comma = FALSE;
+  return FALSE;
+}
+
+static gboolean
+lua_json_obj_end(const gchar *name, const gchar *prefix, gpointer *prefix_data,
+                 const gchar *prev, gpointer *prev_data, gpointer user_data)
+{
+  LuaJsonState *state = (LuaJsonState *) user_data;
+
+  g_string_append_c(state->buffer, '}');
+  state->need_comma = TRUE;
+  return FALSE;
+}
+
+/* numbers and booleans are emitted unquoted if their value matches the type hint */
+static gboolean
+lua_json_append_typed_value(GString *buffer, TypeHint type, const gchar *value)
+{
+  gchar double_buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  gint64 i;
+  gdouble d;
+  gboolean b;
+
+  switch (type)
+    {
+    case TYPE_HINT_INT32:
+    case TYPE_HINT_INT64:
+      if (!type_cast_to_int64(value, &i, NULL))
+        return FALSE;
+      g_string_append_printf(buffer, "%" G_GINT64_FORMAT, i);
+      return TRUE;
+    case TYPE_HINT_DOUBLE:
+      /* strtod() accepts forms JSON does not, e.g. "0x10", ".5" or "+5" */
+      if (!type_cast_to_double(value, &d, NULL) || !isfinite(d))
+        return FALSE;
+      g_string_append(buffer, g_ascii_dtostr(double_buffer, sizeof(double_buffer), d));
+      return TRUE;
+    case TYPE_HINT_BOOLEAN:
+      if (!type_cast_to_boolean(value, &b, NULL))
+        return FALSE;
+      g_string_append(buffer, b ? "true" : "false");
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+static gboolean
+lua_json_value(const gchar *name, const gchar *prefix, TypeHint type,
+               const gchar *value, gsize value_len, gpointer *prefix_data, gpointer user_data)
+{
+  LuaJsonState *state = (LuaJsonState *) user_data;
+
+  lua_json_append_name(state, name);
+  if (!lua_json_append_typed_value(state->buffer, type, value))
+    lua_json_append_escaped(state->buffer, value, value_len);
+  state->need_comma = TRUE;
+  return FALSE;
+}
+
+static int
+lua_json_encode(lua_State *state)
+{
+  LogMessage *msg = lua_check_and_convert_userdata(state, 1, LUA_MESSAGE_TYPE);
+  GlobalConfig *cfg = lua_get_config_from_current_state(state);
+  ValuePairs *vp;
+  LuaJsonState json_state;
+
+  if (!msg)
+    return luaL_argerror(state, 1, "Message expected");
+
+  if (lua_isnoneornil(state, 2))
+    vp = lua_value_pairs_get_default(state);
+  else
+    vp = lua_check_and_convert_userdata(state, 2, LUA_VALUE_PAIRS_TYPE);
+
+  if (!vp)
+    return luaL_argerror(state, 2, "ValuePairs expected");
+
+  json_state.buffer = scratch_buffers_alloc();
+  json_state.need_comma = FALSE;
+
+  value_pairs_walk(vp, lua_json_obj_start, lua_json_value, lua_json_obj_end,
+                   msg, 0, LTZ_SEND, &cfg->template_options, &json_state);
+
+  lua_pushlstring(state, json_state.buffer->str, json_state.buffer->len);
+  return 1;
+}
+
+static const struct luaL_Reg value_pairs_functions[] =
+{
+  {"new", lua_value_pairs_new},
+  {NULL, NULL}
+};
+
+/* drops the default value-pairs object, it is compiled again on the next use */
+void
+lua_value_pairs_reset_default(lua_State *state)
+{
+  lua_pushnil(state);
+  lua_setfield(state, LUA_REGISTRYINDEX, LUA_VALUE_PAIRS_DEFAULT);
+}
+
+void
+lua_register_value_pairs(lua_State *state)
+{
+  luaL_newmetatable(state, LUA_VALUE_PAIRS_TYPE);
+  lua_pushcfunction(state, lua_value_pairs_metatable__gc);
+  lua_setfield(state, -2, "__gc");
+  lua_pop(state, 1);
+
+  luaL_openlib(state, "ValuePairs", value_pairs_functions, 0);
+  lua_pop(state, 1);
+
+  lua_getglobal(state, "syslogng");
+  lua_pushcfunction(state, lua_json_encode);
+  lua_setfield(state, -2, "json_encode");
+  lua_pop(state, 1);
+}
@@ -25,7 +25,12 @@
 #include "logthrdestdrv.h"
 #include "stats/stats.h"
 #include "seqnum.h"
+#include "timeutils.h"
+#include "scratch-buffers.h"
+#include "stats/stats-registry.h"
+#include "stats/stats-cluster-logpipe.h"
 
+#include <iv.h>
 #include <EXTERN.h>
 #include <perl.h>
 
@@ -33,6 +38,22 @@
 #define SCS_PERL 0
 #endif
 
+#define PERL_DEST_DEFAULT_BATCH_TIMEOUT 1000
+#define PERL_DEST_MAX_CACHED_KEYS 1024
+
+/*
+ * Return values of the queue function, available to the script as
+ * syslogng::DROP, syslogng::SUCCESS and so on. Any other true value
+ * counts as SUCCESS, any false value (or an error) as DROP.
+ */
+typedef enum
+{
+  PERL_DEST_RESULT_DROP = 0,
+  PERL_DEST_RESULT_SUCCESS = 1,
+  PERL_DEST_RESULT_RETRY = 2,
+  PERL_DEST_RESULT_ERROR_RECONNECT = 3,
+} PerlDestResult;
+
 typedef struct
 {
   LogThrDestDriver super;
@@ -46,9 +67,39 @@ typedef struct
 
   gint32 seq_num;
 
-  PerlInterpreter *perl;
+  gint batch_size;
+  gint batch_timeout;
+  GPtrArray *batch;
+  struct iv_timer batch_timer;
+  gint batch_retries;
+  gboolean batch_retry_pending;
+
+  gint num_workers;
+  GPtrArray *workers;
+  GAsyncQueue *replies;
 } PerlDestDriver;
 
+typedef struct
+{
+  PerlDestDriver *owner;
+  gint index;
+  PerlInterpreter *perl;
+  GThread *thread;
+  GAsyncQueue *jobs;
+
+  /* owned by the interpreter: shared key SVs by value-pair name, and the
+   * message hashes handed to the queue function, one per batch slot */
+  GHashTable *keys;
+  GPtrArray *kvmaps;
+
+  StatsCounterItem *processed;
+
+  /* the slice of the current round this worker is processing */
+  LogMessage **msgs;
+  guint num_msgs;
+  PerlDestResult *results;
+} PerlDestWorker;
+
 /** Setters & config glue **/
 
 void
@@ -97,6 +148,30 @@ perl_dd_set_value_pairs(LogDriver *d, ValuePairs *vp)
   self->vp = vp;
 }
 
+void
+perl_dd_set_batch_size(LogDriver *d, gint batch_size)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+
+  self->batch_size = batch_size;
+}
+
+void
+perl_dd_set_batch_timeout(LogDriver *d, gint batch_timeout)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+
+  self->batch_timeout = batch_timeout;
+}
+
+void
+perl_dd_set_workers(LogDriver *d, gint num_workers)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+
+  self->num_workers = num_workers;
+}
+
 LogTemplateOptions *
 perl_dd_get_template_options(LogDriver *d)
 {
@@ -146,9 +221,10 @@ perl_dd_format_persist_name(const LogPipe *d)
 /** Perl calling helpers **/
 
 static gboolean
-_call_perl_function_with_no_arguments(PerlDestDriver *self, const gchar *fname)
+_call_perl_function_with_no_arguments(PerlDestWorker *worker, const gchar *fname)
 {
-  PerlInterpreter *my_perl = self->perl;
+  PerlDestDriver *self = worker->owner;
+  PerlInterpreter *my_perl = worker->perl;
   char *args[] = { NULL };
   dSP;
   int count, r = 0;
@@ -181,7 +257,7 @@ _call_perl_function_with_no_arguments(PerlDestDriver *self, const gchar *fname)
                 evt_tag_int("returned-values", count),
                 evt_tag_int("expected-values", 1),
                 NULL);
-      return FALSE;
+      goto exit;
     }
 
   r = POPi;
@@ -206,10 +282,166 @@ xs_init(pTHX)
 
   /* DynaLoader is a special case */
   newXS("DynaLoader::boot_DynaLoader", boot_DynaLoader, file);
+
+  /* defined before the script is compiled, so they can be used as barewords */
+  newCONSTSUB(gv_stashpv("syslogng", GV_ADD), "DROP", newSViv(PERL_DEST_RESULT_DROP));
+  newCONSTSUB(gv_stashpv("syslogng", GV_ADD), "SUCCESS", newSViv(PERL_DEST_RESULT_SUCCESS));
+  newCONSTSUB(gv_stashpv("syslogng", GV_ADD), "RETRY", newSViv(PERL_DEST_RESULT_RETRY));
+  newCONSTSUB(gv_stashpv("syslogng", GV_ADD), "ERROR_RECONNECT", newSViv(PERL_DEST_RESULT_ERROR_RECONNECT));
 }
 
 /** Value pairs **/
 
+/*
+ * Message hashes are reused between calls as long as the script did not
+ * keep a reference to them: values from the previous message are
+ * invalidated (or replaced, if referenced elsewhere) first, then updated
+ * in place by perl_worker_vp_add_one(), and whatever was not set again
+ * is deleted afterwards. Keys are shared SVs with precomputed hashes, so
+ * storing a value neither hashes nor copies the name. Only the first
+ * PERL_DEST_MAX_CACHED_KEYS names get one, so dynamic names (e.g. parsed
+ * JSON keys) do not grow the cache without bound; the rest are hashed on
+ * every store.
+ */
+static SV *
+perl_worker_lookup_key(PerlDestWorker *worker, const gchar *name)
+{
+  PerlInterpreter *my_perl = worker->perl;
+  SV *key;
+
+  key = g_hash_table_lookup(worker->keys, name);
+  if (!key && g_hash_table_size(worker->keys) < PERL_DEST_MAX_CACHED_KEYS)
+    {
+      key = newSVpvn_share(name, strlen(name), 0);
+      g_hash_table_insert(worker->keys, g_strdup(name), key);
+    }
+  return key;
+}
+
+static SV *
+perl_worker_fetch_value(PerlDestWorker *worker, HV *kvmap, const gchar *name)
+{
+  PerlInterpreter *my_perl = worker->perl;
+  SV *key = perl_worker_lookup_key(worker, name);
+  HE *he;
+
+  if (!key)
+    {
+      gsize name_len = strlen(name);
+      SV **value = hv_fetch(kvmap, name, name_len, 0);
+
+      if (value && SvREFCNT(*value) == 1)
+        return *value;
+      return *hv_store(kvmap, name, name_len, newSV(0), 0);
+    }
+
+  he = hv_fetch_ent(kvmap, key, 0, SvSHARED_HASH(key));
+  if (he && SvREFCNT(HeVAL(he)) == 1)
+    return HeVAL(he);
+
+  he = hv_store_ent(kvmap, key, newSV(0), SvSHARED_HASH(key));
+  return HeVAL(he);
+}
+
+static HV *
+perl_worker_prepare_kvmap(PerlDestWorker *worker, guint slot)
+{
+  PerlInterpreter *my_perl = worker->perl;
+  HV *kvmap = NULL;
+  HE *he;
+
+  if (slot < worker->kvmaps->len)
+    kvmap = g_ptr_array_index(worker->kvmaps, slot);
+  else
+    g_ptr_array_set_size(worker->kvmaps, slot + 1);
+
+  if (kvmap && SvREFCNT((SV *)kvmap) > 1)
+    {
+      SvREFCNT_dec((SV *)kvmap);
+      kvmap = NULL;
+    }
+
+  if (!kvmap)
+    {
+      kvmap = newHV();
+      g_ptr_array_index(worker->kvmaps, slot) = kvmap;
+      return kvmap;
+    }
+
+  hv_iterinit(kvmap);
+  while ((he = hv_iternext(kvmap)))
+    {
+      SV *value = HeVAL(he);
+
+      if (SvREFCNT(value) > 1)
+        {
+          HeVAL(he) = newSV(0);
+          SvREFCNT_dec(value);
+        }
+      else
+        /* unlike SvOK_off(), this frees the referent if the script stored a reference */
+        sv_setsv(value, &PL_sv_undef);
+    }
+  return kvmap;
+}
+
+static void
+perl_worker_purge_kvmap(PerlDestWorker *worker, HV *kvmap)
+{
+  PerlInterpreter *my_perl = worker->perl;
+  GPtrArray *stale = NULL;
+  HE *he;
+  guint i;
+
+  hv_iterinit(kvmap);
+  while ((he = hv_iternext(kvmap)))
+    {
+      if (SvOK(HeVAL(he)))
+        continue;
+
+      /* the key may have been added by the script, so it is not
+       * necessarily one of worker->keys */
+      if (!stale)
+        stale = g_ptr_array_new();
+      g_ptr_array_add(stale, newSVhek(HeKEY_hek(he)));
+    }
+
+  if (!stale)
+    return;
+
+  for (i = 0; i < stale->len; i++)
+    {
+      SV *key = g_ptr_array_index(stale, i);
+
+      hv_delete_ent(kvmap, key, G_DISCARD, 0);
+      SvREFCNT_dec(key);
+    }
+  g_ptr_array_free(stale, TRUE);
+}
+
+static void
+perl_worker_free_kvmaps(PerlDestWorker *worker)
+{
+  PerlInterpreter *my_perl = worker->perl;
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  for (i = 0; i < worker->kvmaps->len; i++)
+    {
+      HV *kvmap = g_ptr_array_index(worker->kvmaps, i);
+
+      if (kvmap)
+        SvREFCNT_dec((SV *)kvmap);
+    }
+  g_ptr_array_set_size(worker->kvmaps, 0);
+
+  g_hash_table_iter_init(&iter, worker->keys);
+  while (g_hash_table_iter_next(&iter, NULL, &key))
+    SvREFCNT_dec((SV *)key);
+  g_hash_table_remove_all(worker->keys);
+}
+
 static gboolean
 perl_worker_vp_add_one(const gchar *name,
                        TypeHint type, const gchar *value, gsize value_len,
@@ -217,7 +449,8 @@ perl_worker_vp_add_one(const gchar *name,
 {
   PerlInterpreter *my_perl = (PerlInterpreter *)((gpointer *)user_data)[0];
   HV *kvmap = (HV *)((gpointer *)user_data)[1];
-  PerlDestDriver *self = (PerlDestDriver *)((gpointer *)user_data)[2];
+  PerlDestWorker *worker = (PerlDestWorker *)((gpointer *)user_data)[2];
+  PerlDestDriver *self = worker->owner;
   gboolean need_drop = FALSE;
   gboolean fallback = self->template_options.on_error & ON_ERROR_FALLBACK_TO_STRING;
 
@@ -228,19 +461,19 @@ perl_worker_vp_add_one(const gchar *name,
         gint32 i;
 
         if (type_cast_to_int32(value, &i, NULL))
-          hv_store(kvmap, name, strlen(name), newSViv(i), 0);
+          sv_setiv(perl_worker_fetch_value(worker, kvmap, name), i);
         else
           {
             need_drop = type_cast_drop_helper(self->template_options.on_error,
                                               value, "int");
 
             if (fallback)
-              hv_store(kvmap, name, strlen(name), newSVpv(value, 0), 0);
+              sv_setpvn(perl_worker_fetch_value(worker, kvmap, name), value, value_len);
           }
         break;
       }
     case TYPE_HINT_STRING:
-      hv_store(kvmap, name, strlen(name), newSVpv(value, 0), 0);
+      sv_setpvn(perl_worker_fetch_value(worker, kvmap, name), value, value_len);
       break;
     default:
       need_drop = type_cast_drop_helper(self->template_options.on_error,
@@ -253,62 +486,104 @@ perl_worker_vp_add_one(const gchar *name,
 /** Main code **/
 
 static void
-_perl_thread_init(LogThrDestDriver *d)
+perl_worker_start_interpreter(PerlDestWorker *worker)
 {
-  PerlDestDriver *self = (PerlDestDriver *)d;
+  PerlDestDriver *self = worker->owner;
   PerlInterpreter *my_perl;
   char *argv[] = { "syslog-ng", self->filename };
 
-  self->perl = perl_alloc();
-  perl_construct(self->perl);
-  my_perl = self->perl;
+  /* the interpreter is only used from the thread that starts it, but the
+   * current one is kept per thread, so it is set explicitly */
+  worker->perl = perl_alloc();
+  PERL_SET_CONTEXT(worker->perl);
+  perl_construct(worker->perl);
+  my_perl = worker->perl;
   PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
-  perl_parse(self->perl, xs_init, 2, (char **)argv, NULL);
-
-  if (!self->queue_func_name)
-    self->queue_func_name = g_strdup("queue");
+  perl_parse(worker->perl, xs_init, 2, (char **)argv, NULL);
 
   if (self->init_func_name)
-    _call_perl_function_with_no_arguments(self, self->init_func_name);
+    _call_perl_function_with_no_arguments(worker, self->init_func_name);
 
   msg_verbose("Initializing Perl destination",
               evt_tag_str("driver", self->super.super.super.id),
               evt_tag_str("script", self->filename),
+              evt_tag_int("worker", worker->index),
               NULL);
 }
 
-static worker_insert_result_t
-perl_worker_eval(LogThrDestDriver *d, LogMessage *msg)
+static void
+perl_worker_stop_interpreter(PerlDestWorker *worker)
 {
-  PerlDestDriver *self = (PerlDestDriver *)d;
-  gboolean success, vp_ok;
-  LogPathOptions path_options = LOG_PATH_OPTIONS_INIT;
-  PerlInterpreter *my_perl = self->perl;
-  int count;
-  HV *kvmap;
-  gpointer args[3];
-  dSP;
+  PerlDestDriver *self = worker->owner;
 
-  ENTER;
-  SAVETMPS;
+  PERL_SET_CONTEXT(worker->perl);
+  if (self->deinit_func_name)
+    _call_perl_function_with_no_arguments(worker, self->deinit_func_name);
 
-  PUSHMARK(SP);
+  perl_worker_free_kvmaps(worker);
+  perl_destruct(worker->perl);
+  perl_free(worker->perl);
+  worker->perl = NULL;
+}
 
-  kvmap = newHV();
+/*
+ * Fills the reusable hash of the given batch slot. Returns NULL if the
+ * message is to be dropped because of a value-pairs error.
+ */
+static HV *
+perl_worker_build_message_hash(PerlDestWorker *worker, LogMessage *msg, guint slot)
+{
+  PerlDestDriver *self = worker->owner;
+  HV *kvmap = perl_worker_prepare_kvmap(worker, slot);
+  gpointer args[3];
+  gboolean vp_ok;
 
-  args[0] = self->perl;
+  args[0] = worker->perl;
   args[1] = kvmap;
-  args[2] = self;
+  args[2] = worker;
   vp_ok = value_pairs_foreach(self->vp, perl_worker_vp_add_one,
                               msg, self->seq_num, LTZ_SEND,
                               &self->template_options,
                               args);
 
   if (!vp_ok && (self->template_options.on_error & ON_ERROR_DROP_MESSAGE))
-    goto exit;
+    return NULL;
+
+  perl_worker_purge_kvmap(worker, kvmap);
+  return kvmap;
+}
+
+static PerlDestResult
+perl_worker_convert_result(PerlInterpreter *my_perl, SV *ret)
+{
+  IV r = SvIV(ret);
+
+  switch (r)
+    {
+    case PERL_DEST_RESULT_DROP:
+    case PERL_DEST_RESULT_RETRY:
+    case PERL_DEST_RESULT_ERROR_RECONNECT:
+      return (PerlDestResult) r;
+    default:
+      return PERL_DEST_RESULT_SUCCESS;
+    }
+}
+
+/* calls the queue function with a single argument, taking over its reference */
+static PerlDestResult
+perl_worker_call_queue_func(PerlDestWorker *worker, SV *arg)
+{
+  PerlDestDriver *self = worker->owner;
+  PerlInterpreter *my_perl = worker->perl;
+  PerlDestResult result = PERL_DEST_RESULT_DROP;
+  int count;
+  dSP;
 
-  XPUSHs(sv_2mortal(newRV_noinc((SV *)kvmap)));
+  ENTER;
+  SAVETMPS;
 
+  PUSHMARK(SP);
+  XPUSHs(sv_2mortal(arg));
   PUTBACK;
 
   count = call_pv(self->queue_func_name, G_EVAL | G_SCALAR);
@@ -323,11 +598,10 @@ perl_worker_eval(LogThrDestDriver *d, LogMessage *msg)
                 evt_tag_str("function", self->queue_func_name),
                 evt_tag_str("error-message", SvPV_nolen(ERRSV)),
                 NULL);
-      (void) POPs;
-      success = FALSE;
+      if (count > 0)
+        (void) POPs;
     }
-
-  if (count != 1)
+  else if (count != 1)
     {
       msg_error("Too many values returned by a Perl function",
                 evt_tag_str("driver", self->super.super.super.id),
@@ -336,28 +610,366 @@ perl_worker_eval(LogThrDestDriver *d, LogMessage *msg)
                 evt_tag_int("returned-values", count),
                 evt_tag_int("expected-values", 1),
                 NULL);
-      success = FALSE;
     }
   else
-    {
-      int r = POPi;
-
-      success = (r != 0);
-    }
+    result = perl_worker_convert_result(my_perl, POPs);
 
- exit:
   PUTBACK;
   FREETMPS;
   LEAVE;
 
-  if (success && vp_ok)
+  return result;
+}
+
+/*
+ * Processes the slice of messages assigned to the worker, in its own
+ * interpreter. With batch_size() > 1 the queue function is called once,
+ * with a reference to an array of the message hashes, and its return
+ * value applies to the whole slice.
+ */
+static void
+perl_worker_process(PerlDestWorker *worker)
+{
+  PerlDestDriver *self = worker->owner;
+  PerlInterpreter *my_perl = worker->perl;
+  PerlDestResult result;
+  AV *batch;
+  guint i;
+
+  if (self->batch_size <= 1)
+    {
+      for (i = 0; i < worker->num_msgs; i++)
+        {
+          HV *kvmap = perl_worker_build_message_hash(worker, worker->msgs[i], 0);
+
+          if (kvmap)
+            worker->results[i] = perl_worker_call_queue_func(worker, newRV_inc((SV *)kvmap));
+          else
+            worker->results[i] = PERL_DEST_RESULT_DROP;
+        }
+      stats_counter_add(worker->processed, worker->num_msgs);
+      return;
+    }
+
+  batch = newAV();
+  av_extend(batch, worker->num_msgs);
+  for (i = 0; i < worker->num_msgs; i++)
+    {
+      HV *kvmap = perl_worker_build_message_hash(worker, worker->msgs[i], i);
+
+      if (!kvmap)
+        {
+          worker->results[i] = PERL_DEST_RESULT_DROP;
+          continue;
+        }
+      worker->results[i] = PERL_DEST_RESULT_SUCCESS;
+      av_push(batch, newRV_inc((SV *)kvmap));
+    }
+
+  result = perl_worker_call_queue_func(worker, newRV_noinc((SV *)batch));
+
+  for (i = 0; i < worker->num_msgs; i++)
     {
+      if (worker->results[i] == PERL_DEST_RESULT_SUCCESS)
+        worker->results[i] = result;
+    }
+  stats_counter_add(worker->processed, worker->num_msgs);
+}
+
+/*
+ * Workers: every worker has its own interpreter, created and used only by
+ * the thread running it. The first one lives in the destination thread,
+ * the others in threads of their own. The pending messages of a round are
+ * split into contiguous slices, one per worker; acknowledgement happens in
+ * the destination thread once all slices are done, in queue order.
+ */
+static gchar perl_worker_exit_marker;
+
+static gpointer
+perl_worker_thread(gpointer user_data)
+{
+  PerlDestWorker *worker = (PerlDestWorker *)user_data;
+  PerlDestDriver *self = worker->owner;
+
+  scratch_buffers_allocator_init();
+  perl_worker_start_interpreter(worker);
+  g_async_queue_push(self->replies, worker);
+
+  while (g_async_queue_pop(worker->jobs) != &perl_worker_exit_marker)
+    {
+      perl_worker_process(worker);
+      scratch_buffers_explicit_gc();
+      g_async_queue_push(self->replies, worker);
+    }
+
+  perl_worker_stop_interpreter(worker);
+  scratch_buffers_allocator_deinit();
+  return NULL;
+}
+
+static PerlDestWorker *
+perl_worker_new(PerlDestDriver *owner, gint index)
+{
+  PerlDestWorker *self = g_new0(PerlDestWorker, 1);
+
+  self->owner = owner;
+  self->index = index;
+  self->jobs = g_async_queue_new();
+  self->keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  self->kvmaps = g_ptr_array_new();
+  return self;
+}
+
+static void
+perl_worker_free(PerlDestWorker *self)
+{
+  g_async_queue_unref(self->jobs);
+  g_hash_table_unref(self->keys);
+  g_ptr_array_free(self->kvmaps, TRUE);
+  g_free(self);
+}
+
+static void
+perl_worker_register_stats(PerlDestDriver *self, gboolean do_register)
+{
+  StatsClusterKey sc_key;
+  gchar instance[1024];
+  guint i;
+
+  stats_lock();
+  for (i = 0; i < self->workers->len; i++)
+    {
+      PerlDestWorker *worker = g_ptr_array_index(self->workers, i);
+
+      g_snprintf(instance, sizeof(instance), "%s,worker%d",
+                 self->super.format.stats_instance(&self->super), worker->index);
+      stats_cluster_logpipe_key_set(&sc_key, SCS_PERL | SCS_DESTINATION, self->super.super.super.id, instance);
+
+      if (do_register)
+        stats_register_counter(1, &sc_key, SC_TYPE_PROCESSED, &worker->processed);
+      else
+        stats_unregister_counter(&sc_key, SC_TYPE_PROCESSED, &worker->processed);
+    }
+  stats_unlock();
+}
+
+static worker_insert_result_t
+perl_worker_eval(LogThrDestDriver *d, LogMessage *msg)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+  PerlDestWorker *worker = g_ptr_array_index(self->workers, 0);
+  PerlDestResult result;
+
+  worker->msgs = &msg;
+  worker->num_msgs = 1;
+  worker->results = &result;
+  perl_worker_process(worker);
+
+  switch (result)
+    {
+    case PERL_DEST_RESULT_SUCCESS:
       return WORKER_INSERT_RESULT_SUCCESS;
+    case PERL_DEST_RESULT_RETRY:
+      /* rewound and retried after time_reopen(), at most retries() times */
+      return WORKER_INSERT_RESULT_ERROR;
+    case PERL_DEST_RESULT_ERROR_RECONNECT:
+      /* rewound and retried after time_reopen(), without a limit */
+      return WORKER_INSERT_RESULT_NOT_CONNECTED;
+    default:
+      return WORKER_INSERT_RESULT_DROP;
+    }
+}
+
+static void
+perl_worker_arm_batch_timer(PerlDestDriver *self, glong msec)
+{
+  if (iv_timer_registered(&self->batch_timer))
+    return;
+
+  iv_validate_now();
+  self->batch_timer.expires = iv_now;
+  timespec_add_msec(&self->batch_timer.expires, msec);
+  iv_timer_register(&self->batch_timer);
+}
+
+/* puts the held messages, the newest unacknowledged ones, back to the queue */
+static void
+perl_worker_rewind_batch(PerlDestDriver *self)
+{
+  guint i;
+
+  if (self->batch->len == 0)
+    return;
+
+  log_queue_rewind_backlog(self->super.queue, self->batch->len);
+  for (i = 0; i < self->batch->len; i++)
+    log_msg_unref(g_ptr_array_index(self->batch, i));
+  g_ptr_array_set_size(self->batch, 0);
+}
+
+/*
+ * Batch mode (batch_size() > 1 or workers() > 1): messages are kept
+ * (unacknowledged) until batch_size of them per worker are collected, or
+ * batch_timeout msecs passed since the queue ran empty, then they are
+ * handed to the workers.
+ *
+ * Messages are acknowledged in queue order, so only the results before
+ * the first message the queue function asked to retry are settled: that
+ * message and everything after it stay in the pending batch and are
+ * resubmitted after time_reopen(), at most retries() times for RETRY,
+ * until they succeed for ERROR_RECONNECT. If a new message arrives while
+ * a retry is pending, the pending batch is put back to the queue with it.
+ */
+static void
+perl_worker_flush_batch(PerlDestDriver *self)
+{
+  LogMessage **msgs = (LogMessage **)self->batch->pdata;
+  guint num_msgs = self->batch->len;
+  guint num_workers, start = 0, kept = 0, i;
+  PerlDestResult *results;
+  gboolean retry;
+
+  if (iv_timer_registered(&self->batch_timer))
+    iv_timer_unregister(&self->batch_timer);
+
+  if (num_msgs == 0)
+    return;
+
+  num_workers = MIN(self->workers->len, num_msgs);
+  results = g_new(PerlDestResult, num_msgs);
+
+  for (i = 0; i < num_workers; i++)
+    {
+      PerlDestWorker *worker = g_ptr_array_index(self->workers, i);
+      guint end = (num_msgs * (i + 1)) / num_workers;
+
+      worker->msgs = msgs + start;
+      worker->num_msgs = end - start;
+      worker->results = results + start;
+      start = end;
+
+      if (i > 0)
+        g_async_queue_push(worker->jobs, worker);
+    }
+
+  perl_worker_process(g_ptr_array_index(self->workers, 0));
+
+  for (i = 1; i < num_workers; i++)
+    g_async_queue_pop(self->replies);
+
+  retry = self->batch_retries < self->super.retries.max;
+  for (i = 0; i < num_msgs; i++)
+    {
+      if (results[i] == PERL_DEST_RESULT_ERROR_RECONNECT ||
+          (results[i] == PERL_DEST_RESULT_RETRY && retry))
+        break;
+
+      if (results[i] == PERL_DEST_RESULT_SUCCESS)
+        log_threaded_dest_driver_message_accept(&self->super, msgs[i]);
+      else
+        log_threaded_dest_driver_message_drop(&self->super, msgs[i]);
+    }
+
+  kept = num_msgs - i;
+  memmove(msgs, msgs + i, kept * sizeof(LogMessage *));
+  g_ptr_array_set_size(self->batch, kept);
+  g_free(results);
+
+  if (kept > 0)
+    {
+      msg_error("Perl destination function asked for a retry, resubmitting messages later",
+                evt_tag_str("driver", self->super.super.super.id),
+                evt_tag_int("messages", kept),
+                evt_tag_int("retries", self->batch_retries + 1),
+                evt_tag_int("time_reopen", self->super.time_reopen),
+                NULL);
+      self->batch_retries++;
+      self->batch_retry_pending = TRUE;
+      perl_worker_arm_batch_timer(self, self->super.time_reopen * 1000);
     }
   else
     {
-      return WORKER_INSERT_RESULT_DROP;
+      self->batch_retries = 0;
+      self->batch_retry_pending = FALSE;
+      self->super.retries.counter = 0;
+    }
+}
+
+static void
+perl_worker_batch_timer_expired(void *cookie)
+{
+  perl_worker_flush_batch((PerlDestDriver *)cookie);
+}
+
+static worker_insert_result_t
+perl_worker_eval_batch(LogThrDestDriver *d, LogMessage *msg)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+
+  /* rewind the held messages together with the current one (the rewind
+   * of the threaded destination finds an empty backlog then), they are
+   * offered again after time_reopen() instead of being resubmitted by the
+   * batch timer */
+  if (self->batch_retry_pending)
+    {
+      if (iv_timer_registered(&self->batch_timer))
+        iv_timer_unregister(&self->batch_timer);
+      self->batch_retry_pending = FALSE;
+
+      log_queue_rewind_backlog(self->super.queue, self->batch->len + 1);
+      g_ptr_array_foreach(self->batch, (GFunc) log_msg_unref, NULL);
+      g_ptr_array_set_size(self->batch, 0);
+      return WORKER_INSERT_RESULT_NOT_CONNECTED;
+    }
+
+  g_ptr_array_add(self->batch, msg);
+
+  if (self->batch->len >= (guint) MAX(self->batch_size, 1) * self->workers->len)
+    perl_worker_flush_batch(self);
+
+  return WORKER_INSERT_RESULT_EXPLICIT_ACK_MGMT;
+}
+
+static void
+perl_worker_message_queue_empty(LogThrDestDriver *d)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+
+  if (self->batch->len == 0 || self->batch_retry_pending)
+    return;
+
+  if (self->batch_timeout <= 0)
+    {
+      perl_worker_flush_batch(self);
+      return;
+    }
+
+  perl_worker_arm_batch_timer(self, self->batch_timeout);
+}
+
+static void
+_perl_thread_init(LogThrDestDriver *d)
+{
+  PerlDestDriver *self = (PerlDestDriver *)d;
+  guint i;
+
+  if (!self->queue_func_name)
+    self->queue_func_name = g_strdup("queue");
+
+  perl_worker_start_interpreter(g_ptr_array_index(self->workers, 0));
+
+  for (i = 1; i < self->workers->len; i++)
+    {
+      PerlDestWorker *worker = g_ptr_array_index(self->workers, i);
+
+      worker->thread = g_thread_new("perl-dest-worker", perl_worker_thread, worker);
     }
+
+  /* wait for the init functions to finish */
+  for (i = 1; i < self->workers->len; i++)
+    g_async_queue_pop(self->replies);
+
+  perl_worker_register_stats(self, TRUE);
 }
 
 static gboolean
@@ -365,6 +977,7 @@ perl_worker_init(LogPipe *d)
 {
   PerlDestDriver *self = (PerlDestDriver *)d;
   GlobalConfig *cfg = log_pipe_get_config(d);
+  gint i;
 
   if (!self->filename)
     {
@@ -374,11 +987,36 @@ perl_worker_init(LogPipe *d)
       return FALSE;
     }
 
+  if (self->num_workers <= 0)
+    self->num_workers = 1;
+
+#ifndef MULTIPLICITY
+  /* without MULTIPLICITY the interpreter state lives in globals */
+  if (self->num_workers > 1)
+    {
+      msg_error("Error initializing Perl destination: workers() > 1 needs a Perl built with multiplicity support",
+                evt_tag_str("driver", self->super.super.super.id),
+                evt_tag_int("workers", self->num_workers),
+                NULL);
+      return FALSE;
+    }
+#endif
+
   if (!log_dest_driver_init_method(d))
     return FALSE;
 
   log_template_options_init(&self->template_options, cfg);
 
+  g_ptr_array_set_size(self->workers, 0);
+  for (i = 0; i < self->num_workers; i++)
+    g_ptr_array_add(self->workers, perl_worker_new(self, i));
+
+  if (self->batch_size > 1 || self->num_workers > 1)
+    self->super.worker.insert = perl_worker_eval_batch;
+  else
+    self->super.worker.insert = perl_worker_eval;
+  self->super.worker.worker_message_queue_empty = perl_worker_message_queue_empty;
+
   return log_threaded_dest_driver_start(d);
 }
 
@@ -386,13 +1024,28 @@ static void
 _perl_thread_deinit(LogThrDestDriver *d)
 {
   PerlDestDriver *self = (PerlDestDriver *)d;
+  guint i;
 
-  if (self->deinit_func_name &&
-      !_call_perl_function_with_no_arguments(self, self->deinit_func_name))
-    return;
+  if (!self->batch_retry_pending)
+    perl_worker_flush_batch(self);
+
+  if (iv_timer_registered(&self->batch_timer))
+    iv_timer_unregister(&self->batch_timer);
+  perl_worker_rewind_batch(self);
+  self->batch_retry_pending = FALSE;
+
+  perl_worker_register_stats(self, FALSE);
+
+  for (i = 1; i < self->workers->len; i++)
+    {
+      PerlDestWorker *worker = g_ptr_array_index(self->workers, i);
 
-  perl_destruct(self->perl);
-  perl_free(self->perl);
+      g_async_queue_push(worker->jobs, &perl_worker_exit_marker);
+      g_thread_join(worker->thread);
+      worker->thread = NULL;
+    }
+
+  perl_worker_stop_interpreter(g_ptr_array_index(self->workers, 0));
 }
 
 static void
@@ -409,6 +1062,9 @@ perl_dd_free(LogPipe *d)
 
   if (self->vp)
     value_pairs_unref(self->vp);
+  g_ptr_array_free(self->batch, TRUE);
+  g_ptr_array_free(self->workers, TRUE);
+  g_async_queue_unref(self->replies);
 
   log_threaded_dest_driver_free(d);
 }
@@ -434,6 +1090,16 @@ perl_dd_new(GlobalConfig *cfg)
 
   init_sequence_number(&self->seq_num);
 
+  self->batch_timeout = PERL_DEST_DEFAULT_BATCH_TIMEOUT;
+  self->batch = g_ptr_array_new();
+  IV_TIMER_INIT(&self->batch_timer);
+  self->batch_timer.cookie = self;
+  self->batch_timer.handler = perl_worker_batch_timer_expired;
+
+  self->num_workers = 1;
+  self->workers = g_ptr_array_new_with_free_func((GDestroyNotify) perl_worker_free);
+  self->replies = g_async_queue_new();
+
   log_template_options_defaults(&self->template_options);
   perl_dd_set_value_pairs(&self->super.super.super, value_pairs_new_default(cfg));
 
@@ -34,6 +34,9 @@ void perl_dd_set_queue_func(LogDriver *d, gchar *queue_func_name);
 void perl_dd_set_deinit_func(LogDriver *d, gchar *deinit_func_name);
 void perl_dd_set_filename(LogDriver *d, gchar *filename);
 void perl_dd_set_value_pairs(LogDriver *d, ValuePairs *vp);
+void perl_dd_set_batch_size(LogDriver *d, gint batch_size);
+void perl_dd_set_batch_timeout(LogDriver *d, gint batch_timeout);
+void perl_dd_set_workers(LogDriver *d, gint num_workers);
 
 LogTemplateOptions *perl_dd_get_template_options(LogDriver *d);
 
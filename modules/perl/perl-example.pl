@@ -14,9 +14,22 @@ sub init {
 	print "This is the init function.\n";
 }
 
+# The return value of the queue function decides what happens to the
+# message: syslogng::SUCCESS, syslogng::DROP, syslogng::RETRY (retried
+# after time-reopen(), at most retries() times) or syslogng::ERROR_RECONNECT
+# (retried after time-reopen() until it succeeds).
 sub queue {
 	my ($c) = @_;
 	print "QUEUE: " . Dumper($c) . "\n";
+	return syslogng::SUCCESS;
+}
+
+# With batch-size() set, the queue function receives a reference to an
+# array of message hashes instead of a single hash.
+sub queue_batch {
+	my ($batch) = @_;
+	print "QUEUE BATCH of " . scalar(@$batch) . ": " . Dumper($batch) . "\n";
+	return syslogng::SUCCESS;
 }
 
 sub deinit {
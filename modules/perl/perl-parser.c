@@ -34,6 +34,9 @@ static CfgLexerKeyword perl_keywords[] = {
   { "init_func",                KW_INIT_FUNC },
   { "queue_func",               KW_QUEUE_FUNC },
   { "deinit_func",              KW_DEINIT_FUNC },
+  { "batch_size",               KW_BATCH_SIZE },
+  { "batch_timeout",            KW_BATCH_TIMEOUT },
+  { "workers",                  KW_WORKERS },
   { NULL }
 };
 